@@ -22,7 +22,7 @@
 #include <RN52.h>
 #define NUMBERMACENTRIES 3
 
-String macTable[NUMBERMACENTRIES][2] = {
+const char *macTable[NUMBERMACENTRIES][2] = {
   {"58E28F699B0F","Tom's iPhone"},
   {"C0EEFB5079F0","Thom's OnePlus2"},
   {"60E3AC0E2E15","Jacob's Phone"}
@@ -35,22 +35,12 @@ RN52 rn52(10,11);  //set RX to pin 10 and TX to pin 11 on Arduino (other way rou
 void setup() {
   rn52.begin(38400);   //begin communication at a baud rate of 38400
   Serial.begin(9600);  //begin Serial communication with computer at a baud rate of 9600
-}
-
-String MACtoFriendly(String _mac){
-  
-  if(_mac.equals("NotConnected")){
-    return "Not Connected";
-  }
 
+  //store the friendly names in the RN52 library's device registry (kept in EEPROM,
+  //and only rewritten if they change)
   for(int i=0; i<NUMBERMACENTRIES; i++){
-    //Serial.println(macTable[i][0]);
-     if(_mac.equals(macTable[i][0])){
-      return macTable[i][1];  
-     }
+    rn52.addDevice(macTable[i][0], macTable[i][1]);
   }
-  return "Unknown Device... SAD";
- 
 }
 
 
@@ -62,12 +52,18 @@ void loop() {
   while(Serial.available() == 0);           //wait while there is no data from computer
   if(Serial.read() == 'y')
   {
+    unsigned long printed = 0;
     while(1) {
-      Serial.print("Connected MAC: ");
-      Serial.println(rn52.connectedMAC());
-      Serial.print("Connected device: ");
-      Serial.println(MACtoFriendly(rn52.connectedMAC()));
-      delay(5000);
+      rn52.update();                        //lets the library notice the device connecting and look it up
+      if(millis() - printed > 5000) {
+        Serial.print("Connected MAC: ");
+        Serial.println(rn52.connectedMAC());
+        Serial.print("Connected device: ");
+        if(!rn52.isConnected()) Serial.println("Not Connected");
+        else if(rn52.friendlyName()[0]) Serial.println(rn52.friendlyName());
+        else Serial.println("Unknown Device... SAD");
+        printed = millis();
+      }
     }
   }
 }
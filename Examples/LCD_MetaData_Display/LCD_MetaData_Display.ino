@@ -68,8 +68,9 @@ RN52 rn52(10,11);  //set RX to pin 10 and TX to pin 11 on Arduino (other way rou
  * Globals
  ************************************************************************************/
 
-/* fill in a 12 digit MAC alongside a friendly name */
-String macTable[NUMBERMACENTRIES][2] = {
+/* fill in a 12 digit MAC alongside a friendly name, setup() stores them in
+   the RN52 library's device registry */
+const char *macTable[NUMBERMACENTRIES][2] = {
   {"58E28F699B0F","Tom's iPhone"},
   {"C0EEFB5079F0","Thom's OnePlus2"},
   {"60E3AC0E2E15","Jacob's Phone"}
@@ -79,6 +80,7 @@ String macTable[NUMBERMACENTRIES][2] = {
 bool deviceConnected = false;
 bool newConnection = false;
 String bluetoothName="";
+String deviceName="";
 
 /* determines which information is displayed on the second line of the display */
 int mode = 0;
@@ -109,35 +111,26 @@ scroll_t connectedDevice;
  ******************************************************************************/
 void setup() {
 
-  /* RN52 factory default baud is 115200. Issue command SU,01 at this baud
-  to change to 9600, which works much better with this sketch */
-  rn52.begin(9600);   //begin communication at a baud rate of 38400
-  Serial.begin(115200);  //begin Serial communication with computer at a baud rate of 9600
+  Serial.begin(115200);  //begin Serial communication with computer at a baud rate of 115200
 
   lcd.begin(16,2);     //begin the LCD interface
   lcd.clear();
 
-  /* wait for the RN52 to turn on and decide whether it wants to reconnect */
-  /* these delays exist purely so the RN52 firmware doesnt freak out, we wish they didnt need to be there too */
   lcd.setCursor(0,0);
   lcd.print(make_str("BAL by Doayee"));
-  lcd.setCursor(0,1);
-  lcd.print(make_str("Booting"));
-  delay(500);
-
-  lcd.setCursor(0,1);
-  lcd.print(make_str("Booting."));
-  delay(500);
-
-  lcd.setCursor(0,1);
-  lcd.print(make_str("Booting.."));
-  delay(500);
-
   lcd.setCursor(0,1);
   lcd.print(make_str("Booting..."));
 
+  /* RN52 factory default baud is 115200. Issue command SU,01 at this baud
+  to change to 9600, which works much better with this sketch */
+  /* begin() only returns once the RN52 has booted and accepts commands */
+  rn52.begin(9600);   //begin communication at a baud rate of 9600
+
   bluetoothName = rn52.name();
-  delay(1000);
+
+  /* the registry is kept in EEPROM, and only rewritten if an entry changes */
+  for(int i=0; i<NUMBERMACENTRIES; i++)
+    rn52.addDevice(macTable[i][0], macTable[i][1]);
 
 
   /* either establish that no device connected or pull some data */
@@ -153,6 +146,9 @@ void setup() {
  ******************************************************************************/
 void loop()
 {
+  /* let the library poll the RN52 status, backing off while nothing changes */
+  rn52.update();
+
   /* If it is time to update the data */
   if (millis()-updateMillisCompare > UPDATE_RATE)
   {
@@ -287,26 +283,17 @@ String make_str(String str)
 }
 
 /*******************************************************************************
- * Name:   String MACtoFriendly(String _mac)
- * Inputs: String _mac - the raw MAC to convert
- * Return: String - The friendly name converted from the MAC
- * Notes:  Looks up the friendly name for an input MAC address, and returns it
+ * Name:   String connectedName(void)
+ * Inputs: None
+ * Return: String - The friendly name of the connected device
+ * Notes:  rn52.update() looks the device up in the registry when it connects
  ******************************************************************************/
-String MACtoFriendly(String _mac)
+String connectedName(void)
 {
-  /* Self explanatory */
-  if(_mac.equals("NotConnected")) return "Not Connected";
-
-  else if(_mac.equals("Invalid MAC Address")) return _mac;
-
-  /* Look through the database and return the name paired with it */
-  for(int i=0; i<NUMBERMACENTRIES; i++)
-     if(_mac.equals(macTable[i][0]))
-      return macTable[i][1];
+  if(rn52.friendlyName()[0]) return rn52.friendlyName();
 
   /* Couldn't find it */
   return "Unknown Device... SAD";
-
 }
 
 /*******************************************************************************
@@ -384,6 +371,7 @@ void UpdateData(void)
     delay(100);
     if(!rn52.isConnected()) {
       deviceConnected = false;
+      deviceName = "";
     }
     return;
   }
@@ -393,29 +381,20 @@ void UpdateData(void)
     deviceConnected = true;
     newConnection = true;
 
-    /* connecting splash screen */
-    /* these delays exist purely so the RN52 firmware doesnt freak out, we wish they didnt need to be there too */
+    /* connecting splash screen, shown until the track data below is in */
+    /* no settle delays needed, the library paces the commands that follow */
     lcd.setCursor(0,0);
     lcd.print(make_str("Device Found!"));
-    lcd.setCursor(0,1);
-    lcd.print(make_str("Connecting"));
-    delay(500);
-
-    lcd.setCursor(0,1);
-    lcd.print(make_str("Connecting."));
-    delay(500);
-
-    lcd.setCursor(0,1);
-    lcd.print(make_str("Connecting.."));
-    delay(500);
-
     lcd.setCursor(0,1);
     lcd.print(make_str("Connecting..."));
-    delay(500);
-
+  }
 
+  /* the lookup runs in rn52.update() just after connecting, so the name can arrive a moment later */
+  String name = connectedName();
+  if(!name.equals(deviceName)) {
+    deviceName = name;
     connectedDevice.index = 0;
-    connectedDevice.raw = MACtoFriendly(rn52.connectedMAC());
+    connectedDevice.raw = name;
     connectedDevice.padded = false;
   }
 
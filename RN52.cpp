@@ -31,24 +31,98 @@
 //
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
 #include <Arduino.h>
 #include <RN52.h>
 #include <util/delay_basic.h>
+#include <util/crc16.h>
+
+//
+// Timing
+//
+// Cycles spent outside the tunedDelay() calls in write() and recv(),
+// counted by hand from the compiler output (see begin() for where each
+// one is measured). They depend on the code the compiler generates, so
+// a toolchain that schedules these loops differently can override them
+// with -D rather than editing the library.
+#ifndef RN52_TX_BIT_CYCLES
+#define RN52_TX_BIT_CYCLES 15
+#endif
+#if GCC_VERSION > 40800
+#ifndef RN52_RX_START_CYCLES
+#define RN52_RX_START_CYCLES (4 + 4 + 75 + 17)
+#endif
+#ifndef RN52_RX_BIT_CYCLES
+#define RN52_RX_BIT_CYCLES 23
+#endif
+#ifndef RN52_RX_STOP_CYCLES
+#define RN52_RX_STOP_CYCLES (37 + 11)
+#endif
+#else
+#ifndef RN52_RX_START_CYCLES
+#define RN52_RX_START_CYCLES (4 + 4 + 97 + 29)
+#endif
+#ifndef RN52_RX_BIT_CYCLES
+#define RN52_RX_BIT_CYCLES 11
+#endif
+#ifndef RN52_RX_STOP_CYCLES
+#define RN52_RX_STOP_CYCLES (44 + 17)
+#endif
+#endif
+
+// What RN52_RX_MAJORITY adds on top: per bit, two more pin reads with
+// their vote counts, two tunedDelay() setups and the final compare; and
+// the stop bit read ahead of setRxIntMsk(). Estimated from the added
+// instruction sequence rather than timed on hardware, so check them
+// with a logic analyser (_DEBUG) before relying on the top baud rates.
+#ifndef RN52_RX_VOTE_CYCLES
+#define RN52_RX_VOTE_CYCLES 32
+#endif
+#ifndef RN52_RX_FRAME_CYCLES
+#define RN52_RX_FRAME_CYCLES 10
+#endif
+
+#if RN52_TRACE_SIZE
+#define RN52_TRACE(event, arg) trace(event, arg)
+#else
+#define RN52_TRACE(event, arg) ((void)0)
+#endif
 
 //
 // Statics
 //
 RN52 *RN52::active_object = 0;
+RN52 *RN52::_instances = 0;
+RN52 *RN52::_serviceNext = 0;
 char RN52::_receive_buffer[_SS_MAX_RX_BUFF];
 volatile uint8_t RN52::_receive_buffer_tail = 0;
 volatile uint8_t RN52::_receive_buffer_head = 0;
+#ifndef RN52_NO_GPIO
 short RN52::IOMask = 0x0004;
 short RN52::IOProtect = 0x3C64;
 short RN52::IOStateMask = 0x0094;
 short RN52::IOStateProtect = 0x3CF4;
-short RN52::IO;
-short RN52::IOState;
-volatile bool  RN52::_trackChanged = false;
+#endif
+#if RN52_RECORD_SIZE
+RN52Record RN52::_record[RN52_RECORD_SIZE];
+uint16_t RN52::_recordHead = 0;
+uint16_t RN52::_recordCount = 0;
+unsigned long RN52::_recordLast = 0;
+bool RN52::_recording = false;
+const RN52Record *RN52::_replay = 0;
+uint16_t RN52::_replayLeft = 0;
+unsigned long RN52::_replayLast = 0;
+uint16_t RN52::_replayMismatches = 0;
+#endif
+#if RN52_TRACE_SIZE
+RN52::TraceEntry RN52::_trace[RN52_TRACE_SIZE];
+uint8_t RN52::_traceHead = 0;
+uint8_t RN52::_traceCount = 0;
+volatile uint8_t RN52::_traceReceived = 0;
+volatile uint8_t RN52::_traceOverflowByte;
+volatile uint8_t RN52::_traceFramingByte;
+#endif
 
 //
 // Debugging
@@ -136,6 +210,10 @@ void RN52::recv()
 #endif
 
   uint8_t d = 0;
+#if RN52_TRACE_SIZE
+  bool overflowed = false;
+  bool misframed = false;
+#endif
 
   // If RX line is high, then we don't see any start bit
   // so interrupt is probably not for us
@@ -156,8 +234,23 @@ void RN52::recv()
       tunedDelay(_rx_delay_intrabit);
       d >>= 1;
       DebugPulse(_DEBUG_PIN2, 1);
+#if RN52_RX_MAJORITY
+      // Samples either side of the centre, so a glitch on one loses
+      uint8_t votes = 0;
+      if (rx_pin_read())
+        votes++;
+      tunedDelay(_rx_delay_spread);
+      if (rx_pin_read())
+        votes++;
+      tunedDelay(_rx_delay_spread);
+      if (rx_pin_read())
+        votes++;
+      if (votes >= 2)
+        d |= 0x80;
+#else
       if (rx_pin_read())
         d |= 0x80;
+#endif
     }
 
     if (_inverse_logic)
@@ -175,15 +268,48 @@ void RN52::recv()
     {
       DebugPulse(_DEBUG_PIN1, 1);
       _buffer_overflow = true;
+#if RN52_TRACE_SIZE
+      overflowed = true;
+#endif
     }
 
     // skip the stop bit
     tunedDelay(_rx_delay_stopbit);
     DebugPulse(_DEBUG_PIN1, 1);
 
+#if RN52_RX_MAJORITY
+    // A line that isn't idle here means we lost the byte boundaries
+    if (_inverse_logic ? rx_pin_read() : !rx_pin_read())
+    {
+      _framingError = true;
+      _framingErrors++;
+#if RN52_TRACE_SIZE
+      misframed = true;
+#endif
+    }
+#endif
+
     // Re-enable interrupts when we're sure to be inside the stop bit
     setRxIntMsk(true);
 
+#if RN52_TRACE_SIZE
+    // Only note them: calling trace() from here would make gcc save every
+    // call-clobbered register on entry, ahead of the first sample, and
+    // throw RN52_RX_START_CYCLES off. traceReceived() traces them later.
+    if (overflowed)
+    {
+      _traceOverflowByte = d;
+      _traceReceived |= 1;
+    }
+#if RN52_RX_MAJORITY
+    if (misframed)
+    {
+      _traceFramingByte = d;
+      _traceReceived |= 2;
+    }
+#endif
+#endif
+
   }
 
 #if GCC_VERSION < 40302
@@ -247,9 +373,106 @@ RN52::RN52(uint8_t receivePin, uint8_t transmitPin, bool inverse_logic /* = fals
   _rx_delay_intrabit(0),
   _rx_delay_stopbit(0),
   _tx_delay(0),
+  _rx_delay_spread(0),
   _buffer_overflow(false),
-  _inverse_logic(inverse_logic)
+  _inverse_logic(inverse_logic),
+  _framingError(false),
+  _framingErrors(0),
+  _bootTime(0),
+#ifndef RN52_NO_CONFIG
+  _cacheEnabled(false),
+#endif
+#ifndef RN52_NO_METADATA
+  _metaDataCallback(NULL),
+  _metaSeen(0),
+  _metaTrack(0),
+  _metaTracks(0),
+  _asyncLen(0),
+  _asyncLines(0),
+  _asyncLast(0),
+  _asyncActive(false),
+#endif
+  _trackLength(0),
+  _anchorPosition(0),
+  _anchorTime(0),
+  _playing(false),
+  _volumeSteps(0),
+  _skipSteps(0),
+  _volume(-1),
+  _volumeTarget(-1),
+  _volumeCalibrate(0),
+  _verifySkips(false),
+  _skipFrom(0),
+  _skipSent(0),
+  _skipDone(0),
+  _skipLanded(false),
+#ifndef RN52_NO_METADATA
+  _skipAsked(false),
+#endif
+  _pacingUsed(0),
+  _pacingNext(0),
+  _pacingCurrent(NULL),
+  _pacingLast(NULL),
+  _lastCommand(0),
+  _blind(false),
+  _commandStart(0),
+  _commandCount(0),
+  _commandTime(0),
+  _urgentLatency(0),
+  _urgentLatencyMax(0),
+  _eventPin(0xFF),
+  _eventSeen(0),
+  _lastPoll(0),
+  _pollInterval(RN52_POLL_MIN),
+#ifndef RN52_NO_CALLS
+  _onRing(NULL),
+  _onAnswer(NULL),
+  _onHangUp(NULL),
+  _callLatency(0),
+#endif
+  _lowPower(false),
+  _sleepTime(0),
+  _sleepMicros(0)
+#ifndef RN52_NO_CONNECTION
+  , _reconnectStart(0),
+  _reconnectTimeout(0),
+  _connectTime(0),
+  _connectPending(false)
+#endif
+#ifndef RN52_NO_CONFIG
+  , _snapshotUnverified(0),
+  _snapshotStale(false)
+#endif
 {
+#ifndef RN52_NO_CONNECTION
+  _friendlyName[0] = 0;
+#endif
+  _status = RN52DecodeStatus(0);
+  _trackChanged = false;
+#ifndef RN52_NO_GPIO
+  IO = IOState = 0;
+#endif
+#ifndef RN52_NO_CALLS
+  _callerID[0] = 0;
+#endif
+
+  _lanes[RN52_URGENT].head = _lanes[RN52_URGENT].tail = 0;
+  _lanes[RN52_NORMAL].head = _lanes[RN52_NORMAL].tail = 0;
+
+#ifndef RN52_NO_CONFIG
+  static const char opcodes[RN52_CACHE_SIZE] = { 'N', '%', '|', '^', 'S' };
+  for (uint8_t i = 0; i < RN52_CACHE_SIZE; i++)
+  {
+    _cache[i].opcode = opcodes[i];
+    _cache[i].valid = false;
+    _cache[i].ttl = 0;
+    _cache[i].ownTTL = false;
+  }
+#endif
+
+  _nextInstance = _instances;
+  _instances = this;
+
   setTX(transmitPin);
   setRX(receivePin);
 }
@@ -260,6 +483,17 @@ RN52::RN52(uint8_t receivePin, uint8_t transmitPin, bool inverse_logic /* = fals
 RN52::~RN52()
 {
   end();
+
+  for (RN52 **p = &_instances; *p; p = &(*p)->_nextInstance)
+  {
+    if (*p == this)
+    {
+      *p = _nextInstance;
+      break;
+    }
+  }
+  if (_serviceNext == this)
+    _serviceNext = _nextInstance;
 }
 
 void RN52::setTX(uint8_t tx)
@@ -297,7 +531,7 @@ uint16_t RN52::subtract_cap(uint16_t num, uint16_t sub) {
 // Public methods
 //
 
-void RN52::begin(long speed)
+void RN52::RN52_BEGIN(long speed)
 {
   _rx_delay_centering = _rx_delay_intrabit = _rx_delay_stopbit = _tx_delay = 0;
 
@@ -309,7 +543,7 @@ void RN52::begin(long speed)
   // 12 (gcc 4.8.2) or 14 (gcc 4.3.2) cycles from last bit to stop bit
   // These are all close enough to just use 15 cycles, since the inter-bit
   // timings are the most critical (deviations stack 8 times)
-  _tx_delay = subtract_cap(bit_delay, 15 / 4);
+  _tx_delay = subtract_cap(bit_delay, RN52_TX_BIT_CYCLES / 4);
 
   // Only setup rx when we have a valid PCINT for this pin
   if (digitalPinToPCICR(_receivePin)) {
@@ -327,11 +561,9 @@ void RN52::begin(long speed)
     // We want to have a total delay of 1.5 bit time. Inside the loop,
     // we already wait for 1 bit time - 23 cycles, so here we wait for
     // 0.5 bit time - (71 + 18 - 22) cycles.
-    _rx_delay_centering = subtract_cap(bit_delay / 2, (4 + 4 + 75 + 17 - 23) / 4);
-
+    //
     // There are 23 cycles in each loop iteration (excluding the delay)
-    _rx_delay_intrabit = subtract_cap(bit_delay, 23 / 4);
-
+    //
     // There are 37 cycles from the last bit read to the start of
     // stopbit delay and 11 cycles from the delay until the interrupt
     // mask is enabled again (which _must_ happen during the stopbit).
@@ -339,15 +571,36 @@ void RN52::begin(long speed)
     // delay will be at 1/4th of the stopbit. This allows some extra
     // time for ISR cleanup, which makes 115200 baud at 16Mhz work more
     // reliably
-    _rx_delay_stopbit = subtract_cap(bit_delay * 3 / 4, (37 + 11) / 4);
     #else // Timings counted from gcc 4.3.2 output
     // Note that this code is a _lot_ slower, mostly due to bad register
     // allocation choices of gcc. This works up to 57600 on 16Mhz and
     // 38400 on 8Mhz.
-    _rx_delay_centering = subtract_cap(bit_delay / 2, (4 + 4 + 97 + 29 - 11) / 4);
-    _rx_delay_intrabit = subtract_cap(bit_delay, 11 / 4);
-    _rx_delay_stopbit = subtract_cap(bit_delay * 3 / 4, (44 + 17) / 4);
     #endif
+#if RN52_RX_MAJORITY
+    // The three samples of a bit sit at centre - spread, centre and
+    // centre + spread. Between bits that takes two spreads and the vote's
+    // own instructions off the wait. Bit 0 has no vote before it, so the
+    // centering delay gives both back and then ends one spread early:
+    //   1.5 bit - spread = START + centering + intrabit
+    // With the counts here, at 16 MHz the samples land at about -1/8, 0
+    // and +1/8 bit of the centre (416 units with a spread of 52 at 9600,
+    // 69 with a spread of 8 at 57600), and the stop bit check at 1/4 of
+    // the stop bit as without voting.
+    _rx_delay_spread = bit_delay / 8 ? bit_delay / 8 : 1;
+    _rx_delay_centering = subtract_cap(bit_delay / 2 + _rx_delay_spread,
+                                       (RN52_RX_START_CYCLES - RN52_RX_BIT_CYCLES - RN52_RX_VOTE_CYCLES) / 4);
+    // The vote's instructions come out of the following bit's wait, or
+    // the error would add up over the 8 bits, and the stop bit check out
+    // of the stop bit wait, so the interrupt is re-enabled on time
+    _rx_delay_intrabit = subtract_cap(bit_delay - 2 * _rx_delay_spread,
+                                      (RN52_RX_BIT_CYCLES + RN52_RX_VOTE_CYCLES) / 4);
+    _rx_delay_stopbit = subtract_cap(bit_delay * 3 / 4 - _rx_delay_spread,
+                                     (RN52_RX_STOP_CYCLES + RN52_RX_FRAME_CYCLES) / 4);
+#else
+    _rx_delay_centering = subtract_cap(bit_delay / 2, (RN52_RX_START_CYCLES - RN52_RX_BIT_CYCLES) / 4);
+    _rx_delay_intrabit = subtract_cap(bit_delay, RN52_RX_BIT_CYCLES / 4);
+    _rx_delay_stopbit = subtract_cap(bit_delay * 3 / 4, RN52_RX_STOP_CYCLES / 4);
+#endif
 
 
     // Enable the PCINT for the entire port here, but never disable it
@@ -369,6 +622,11 @@ void RN52::begin(long speed)
 #endif
 
   listen();
+
+  // The RN52 powers up alongside us, so time to ready is counted from
+  // our own reset rather than from this call
+  if (_rx_delay_stopbit && waitReady())
+    _bootTime = millis();
 }
 
 void RN52::setRxIntMsk(bool enable)
@@ -384,6 +642,17 @@ void RN52::end()
   stopListening();
 }
 
+// Bytes whose stop bit was missing since begin(), always 0 unless built
+// with RN52_RX_MAJORITY
+uint16_t RN52::framingErrors()
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  uint16_t n = _framingErrors;
+  SREG = oldSREG;
+  return n;
+}
+
 
 // Read data from buffer
 int RN52::read()
@@ -391,6 +660,13 @@ int RN52::read()
   if (!isListening())
     return -1;
 
+#if RN52_RECORD_SIZE
+  replayPump();
+#endif
+#if RN52_TRACE_SIZE
+  traceReceived();
+#endif
+
   // Empty buffer?
   if (_receive_buffer_head == _receive_buffer_tail)
     return -1;
@@ -398,14 +674,85 @@ int RN52::read()
   // Read from "head"
   uint8_t d = _receive_buffer[_receive_buffer_head]; // grab next byte
   _receive_buffer_head = (_receive_buffer_head + 1) % _SS_MAX_RX_BUFF;
+#if RN52_RECORD_SIZE
+  record(d, false);
+#endif
   return d;
 }
 
+// Copy up to size bytes that have already arrived into dst, without
+// waiting. Stops after delim, unless it is -1. The ISR only ever moves
+// the tail and we only move the head, so a single read of the tail is
+// all the synchronisation needed.
+size_t RN52::take(uint8_t *dst, size_t size, int delim)
+{
+  if (!isListening())
+    return 0;
+
+#if RN52_RECORD_SIZE
+  replayPump();
+#endif
+#if RN52_TRACE_SIZE
+  traceReceived();
+#endif
+
+  uint8_t head = _receive_buffer_head;
+  uint8_t tail = _receive_buffer_tail;
+  size_t count = 0;
+  bool found = false;
+  while (count < size && head != tail && !found)
+  {
+    // The contiguous run up to the tail or the end of the ring
+    size_t chunk = (head < tail ? tail : _SS_MAX_RX_BUFF) - head;
+    if (chunk > size - count)
+      chunk = size - count;
+    if (delim >= 0)
+    {
+      const void *end = memchr(_receive_buffer + head, delim, chunk);
+      if (end)
+      {
+        chunk = (const char *)end - (_receive_buffer + head) + 1;
+        found = true;
+      }
+    }
+    memcpy(dst + count, _receive_buffer + head, chunk);
+    count += chunk;
+    head = (head + chunk) % _SS_MAX_RX_BUFF;
+  }
+  _receive_buffer_head = head;
+
+#if RN52_RECORD_SIZE
+  for (size_t i = 0; i < count; i++)
+    record(dst[i], false);
+#endif
+  return count;
+}
+
+// Read whatever has arrived, up to size bytes. Returns the number read.
+size_t RN52::read(uint8_t *buffer, size_t size)
+{
+  return take(buffer, size, -1);
+}
+
+// As read(), but stops after delim. The last byte read is delim if it
+// was found.
+size_t RN52::readUntil(char delim, char *buffer, size_t size)
+{
+  return take((uint8_t *)buffer, size, (uint8_t)delim);
+}
+
 int RN52::available()
 {
   if (!isListening())
     return 0;
 
+#if RN52_RECORD_SIZE
+  replayPump();
+#endif
+#if RN52_TRACE_SIZE
+  traceReceived();
+#endif
+
   return (_receive_buffer_tail + _SS_MAX_RX_BUFF - _receive_buffer_head) % _SS_MAX_RX_BUFF;
 }
 
@@ -416,6 +763,20 @@ size_t RN52::write(uint8_t b)
     return 0;
   }
 
+#if RN52_RECORD_SIZE
+  record(b, true);
+  if (_replayLeft)
+  {
+    // the module isn't there, check the byte against the recording
+    if (!(_replay->delta & RN52_RECORD_TX) || _replay->data != b)
+      _replayMismatches++;
+    if (_replay->delta & RN52_RECORD_TX)
+      replayNext();
+    _replayLast = millis();
+    return 1;
+  }
+#endif
+
   // By declaring these as local variables, the compiler will put them
   // in registers _before_ disabling interrupts and entering the
   // critical timing sections below, which makes it a lot easier to
@@ -464,6 +825,15 @@ size_t RN52::write(uint8_t b)
   return 1;
 }
 
+// Same as the default, but without a virtual call per byte
+size_t RN52::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (n < size && RN52::write(buffer[n]))
+    n++;
+  return n;
+}
+
 void RN52::flush()
 {
   if (!isListening())
@@ -480,6 +850,13 @@ int RN52::peek()
   if (!isListening())
     return -1;
 
+#if RN52_RECORD_SIZE
+  replayPump();
+#endif
+#if RN52_TRACE_SIZE
+  traceReceived();
+#endif
+
   // Empty buffer
   if (_receive_buffer_head == _receive_buffer_tail)
     return -1;
@@ -488,217 +865,1328 @@ int RN52::peek()
   return _receive_buffer[_receive_buffer_head];
 }
 
-//For use with the GPIO on the rn52, sets inputs and outputs
-bool RN52::GPIOPinMode(int pin, bool state)
+#if RN52_TRACE_SIZE
+//
+// Event trace
+//
+// A ring of timestamped events. The receive interrupt only notes its
+// own events, which the reading side then traces, as it does for the
+// traffic recorder, so each entry is still claimed and filled with
+// interrupts off in case a sketch traces from an interrupt of its own. A dump is six bytes per entry, the micros() time (low
+// byte first), event and arg, oldest first.
+
+void RN52::trace(uint8_t event, uint8_t arg)
 {
-  if (state) IO = IO | (1 << pin);
-  else {
-    short mask = 65535 ^ (1 << pin);
-    IO = IO & mask;
-  }
-  short toWrite = (IO | IOMask) & IOProtect;
-  print("I@,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256) print("0");
-  if (toWrite < 16) print("0");
-  println(toWrite, HEX);
-  while (available() == 0);
-  char c = read();
-  if (c == 'A') {
-    delay(100);
-    flush();
-    return 1;
-  }
-  else {
-    delay(100);
-    flush();
-    return 0;
-  }
-  delay(50);
+  uint8_t oldSREG = SREG;
+  cli();
+  TraceEntry &e = _trace[_traceHead];
+  e.time = micros();
+  e.event = event;
+  e.arg = arg;
+  _traceHead = (_traceHead + 1) & (RN52_TRACE_SIZE - 1);
+  if (_traceCount < RN52_TRACE_SIZE)
+    _traceCount++;
+  SREG = oldSREG;
 }
 
-//Writes outputs high or low, if inputs enables/disables internal pullup
-void RN52::GPIODigitalWrite(int pin, bool state)
+// Trace what recv() noted since the last call
+void RN52::traceReceived()
 {
-  if (state) IOState = IOState | (1 << pin);
-  else {
-    short mask = 65535 ^ (1 << pin);
-    IOState = IOState & mask;
-  }
-  short toWrite = (IOState | IOStateMask) & IOStateProtect;
-  print("I&,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256) print("0");
-  if (toWrite < 16) print("0");
-  println(toWrite, HEX);
-  delay(50);
+  if (!_traceReceived)
+    return;
+
+  uint8_t oldSREG = SREG;
+  cli();
+  uint8_t events = _traceReceived;
+  uint8_t overflowByte = _traceOverflowByte;
+  uint8_t framingByte = _traceFramingByte;
+  _traceReceived = 0;
+  SREG = oldSREG;
+
+  if (events & 1)
+    trace(RN52_TRACE_OVERFLOW, overflowByte);
+  if (events & 2)
+    trace(RN52_TRACE_FRAMING, framingByte);
 }
 
-//reads back the current state of the GPIO
-bool RN52::GPIODigitalRead(int pin)
+void RN52::clearTrace()
 {
-  while (available() > 0)
-  {
-    char c = read();
-  }
-  println("I&");
-  delay(100);
-  short valueIn = 0;
-  for (int i = 0; i < 4; i++)
-  {
-    while (available() == 0);
-    char c = read();
-    if (c >= '0' && c <= '9')
-    {
-      valueIn *= 16;
-      valueIn += (c - '0');
-    }
-    else if (c >= 'A' && c <= 'F')
-    {
-      valueIn *= 16;
-      valueIn += (c - 'A') + 10;
-    }
-  }
-  return (valueIn & (1 << pin)) >> pin;
+  uint8_t oldSREG = SREG;
+  cli();
+  _traceHead = _traceCount = 0;
+  SREG = oldSREG;
 }
 
-void RN52::setDiscoverability(bool discoverable)
+size_t RN52::dumpTrace(Print &out)
 {
-  print("@,");
-  println(discoverable);
-  delay(50);
+  traceReceived();
+
+  // Take a copy so events traced while we print don't tear entries
+  uint8_t oldSREG = SREG;
+  cli();
+  uint8_t count = _traceCount;
+  uint8_t i = (_traceHead - count) & (RN52_TRACE_SIZE - 1);
+  SREG = oldSREG;
+
+  size_t n = 0;
+  for (; count > 0; count--)
+  {
+    cli();
+    TraceEntry e = _trace[i];
+    SREG = oldSREG;
+    n += out.write((const uint8_t *)&e.time, sizeof(e.time));
+    n += out.write(e.event);
+    n += out.write(e.arg);
+    i = (i + 1) & (RN52_TRACE_SIZE - 1);
+  }
+  return n;
 }
+#endif
 
-void RN52::toggleEcho()
+#if RN52_RECORD_SIZE
+//
+// Traffic recorder
+//
+// Bytes are recorded as the library sends and reads them, not as they
+// arrive, so recording adds nothing to the receive interrupt. A dump is
+// three bytes per record, delta low, delta high, data, oldest first.
+
+void RN52::startRecording()
 {
-  println("+");
-  delay(50);
+  _recordHead = _recordCount = 0;
+  _recordLast = millis();
+  _recording = true;
 }
 
-void RN52::name(String nom, bool normalized)
+void RN52::record(uint8_t data, bool tx)
 {
-  print("S");
-  if (normalized) print("-,");
-  else print("N,");
-  println(nom);
-  delay(50);
+  if (!_recording)
+    return;
+
+  unsigned long now = millis();
+  unsigned long delta = now - _recordLast;
+  _recordLast = now;
+  if (delta > RN52_RECORD_DELTA_MAX)
+    delta = RN52_RECORD_DELTA_MAX;
+
+  RN52Record &r = _record[_recordHead];
+  r.delta = delta | (tx ? RN52_RECORD_TX : 0);
+  r.data = data;
+  _recordHead = (_recordHead + 1) % RN52_RECORD_SIZE;
+  if (_recordCount < RN52_RECORD_SIZE)
+    _recordCount++;
 }
 
-String RN52::name(void)
+size_t RN52::dumpRecording(Print &out)
 {
-  while (available() > 0)
-  {
-    char c = read();
-  }
-  println("GN");
-  String nom;
-  char c;
-  while (available() == 0);
- do
+  uint16_t i = (_recordHead + RN52_RECORD_SIZE - _recordCount) % RN52_RECORD_SIZE;
+  size_t n = 0;
+  for (uint16_t left = _recordCount; left > 0; left--)
   {
-    c = read();
-    nom = nom + c;
+    const RN52Record &r = _record[i];
+    n += out.write(r.delta & 0xFF);
+    n += out.write(r.delta >> 8);
+    n += out.write(r.data);
+    i = (i + 1) % RN52_RECORD_SIZE;
   }
-  while (c != '\r');
-  int len=nom.length();
-  nom.remove(len - 1);
-  return nom;
+  return n;
 }
 
-void RN52::factoryReset()
+// Feed a recording back in place of the module. Recorded replies are
+// released no sooner than their delta after the previous record, and
+// not before the library has sent the bytes recorded ahead of them.
+// Bytes sent that differ from the recording are counted as mismatches.
+// The RX line is ignored until the recording runs out.
+void RN52::replay(const RN52Record *records, uint16_t count)
 {
-  println("SF,1");
-  delay(50);
+  listen();
+  setRxIntMsk(false);
+  flush();
+  _replay = records;
+  _replayLeft = count;
+  _replayLast = millis();
+  _replayMismatches = 0;
+  if (!count)
+    setRxIntMsk(true);
 }
 
-int RN52::idlePowerDownTime(void)
+void RN52::replayNext()
+{
+  _replay++;
+  if (--_replayLeft == 0)
+    setRxIntMsk(true);
+}
+
+void RN52::replayPump()
 {
-  while (available() > 0)
+  while (_replayLeft && !(_replay->delta & RN52_RECORD_TX))
   {
-    char c = read();
+    unsigned long now = millis();
+    if (now - _replayLast < _replay->delta)
+      return;
+
+    uint8_t next = (_receive_buffer_tail + 1) % _SS_MAX_RX_BUFF;
+    if (next == _receive_buffer_head)
+      return; // wait for the reader to make room
+    _receive_buffer[_receive_buffer_tail] = _replay->data;
+    _receive_buffer_tail = next;
+    _replayLast = now;
+    replayNext();
   }
-  int timer = 0;
-  println("G^");
-  while (available() == 0);
-  delay(50);
-  while (available() > 2)
+}
+#endif
+
+//
+// Waiting
+//
+// With lowPower() on, every wait for the module puts the MCU into idle
+// sleep. Idle keeps the clocks running, so the RX pin change interrupt
+// wakes us with only 4 extra cycles before recv() starts sampling (well
+// inside the start bit even at 115200 baud), and the millis() timer wakes
+// us at least every 1.024ms to check deadlines.
+
+void RN52::idle()
+{
+  if (!_lowPower)
+    return;
+
+  unsigned long start = micros();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sleep_cpu();
+  sleep_disable();
+
+  _sleepMicros += micros() - start;
+  if (_sleepMicros >= 1000)
   {
-    char c = read();
-    timer *= 10;
-    timer += (c - '0');
-    delay(50);
+    _sleepTime += _sleepMicros / 1000;
+    _sleepMicros %= 1000;
   }
-  return timer;
 }
 
-void RN52::idlePowerDownTime(int timer)
+// Read one line of a reply into buf, without the trailing "\r\n".
+// Characters beyond len - 1 are dropped. Returns the line length, or -1
+// if no complete line arrived within timeout ms.
+int RN52::readLine(char *buf, int len, unsigned long timeout)
 {
-  print("S^,");
-  println(timer);
-  delay(50);
+  unsigned long start = millis();
+  int n = 0;
+  bool started = false;
+  while (millis() - start < timeout)
+  {
+    if (available() == 0)
+    {
+      idle();
+      continue;
+    }
+    if (!started)
+    {
+      RN52_TRACE(RN52_TRACE_FIRST_BYTE, peek());
+      started = true;
+    }
+    if (takeLine(buf, n, len))
+    {
+      RN52_TRACE(RN52_TRACE_LAST_BYTE, n);
+      return n;
+    }
+  }
+  buf[n] = 0;
+  RN52_TRACE(RN52_TRACE_TIMEOUT, n);
+  return -1;
 }
 
-void RN52::reboot()
+// Move what has arrived of a line into buf, from buf[n] on, dropping
+// '\r' and anything beyond len - 1. Returns true once the line's '\n'
+// has been read. buf is always left terminated.
+bool RN52::takeLine(char *buf, int &n, int len)
 {
-  println("R,1");
-  delay(2000);
+  char spill[8];
+  for (;;)
+  {
+    bool room = n < len - 1;
+    char *dst = room ? buf + n : spill;
+    size_t got = readUntil('\n', dst, room ? len - 1 - n : sizeof(spill));
+    if (got == 0)
+    {
+      buf[n] = 0;
+      return false;
+    }
+
+    bool end = dst[got - 1] == '\n';
+    if (room)
+    {
+      // squeeze out the '\r' and '\n' in place
+      for (size_t i = 0; i < got; i++)
+        if (dst[i] != '\r' && dst[i] != '\n')
+          buf[n++] = dst[i];
+    }
+    if (end)
+    {
+      buf[n] = 0;
+      return true;
+    }
+  }
 }
 
-void RN52::call(String number)
+// Send a query and read its one line answer into reply. The query is
+// sent again if the RN52 answers '?' or '!' or doesn't answer at all.
+// A late AOK or ERR left by an earlier command is skipped, it would
+// otherwise parse as a register value (0xA for AOK). Returns false if it
+// never gave a proper answer.
+bool RN52::query(const char *cmd, char *reply, int len)
 {
-  print("A,");
-  println(number);
-  delay(50);
+  for (uint8_t attempt = 0; attempt < RN52_QUERY_RETRIES; attempt++)
+  {
+    settle();
+    RN52_TRACE(RN52_TRACE_COMMAND, cmd[0]);
+    println(cmd);
+    int n;
+    while ((n = readLine(reply, len, RN52_REPLY_TIMEOUT)) >= 0 &&
+           (strcmp(reply, "AOK") == 0 || strcmp(reply, "ERR") == 0))
+      ;
+    if (n < 0)
+      continue;
+    if (framingError())
+      continue;
+    if (strcmp(reply, "?") != 0 && strcmp(reply, "!") != 0)
+      return true;
+  }
+  reply[0] = 0;
+  return false;
 }
 
-void RN52::endCall()
+// Send a query and parse the hex word it answers with. Returns false,
+// leaving value alone, if it never answered.
+bool RN52::queryHex(const char *cmd, short &value)
 {
-  println("E");
-  delay(50);
+  char line[8];
+  if (!query(cmd, line, sizeof(line)))
+    return false;
+  value = RN52ParseHex(line);
+  return true;
 }
 
-void RN52::playPause()
+// Print a 16 bit register as the four hex digits the RN52 expects
+void RN52::printHex(short value)
 {
-  println("AP");
-  delay(50);
+  uint16_t v = value;
+  if (v < 4096) print("0");
+  if (v < 256)  print("0");
+  if (v < 16)   print("0");
+  println(v, HEX);
 }
 
-void RN52::nextTrack()
+#ifndef RN52_NO_CONFIG
+//
+// Read cache
+//
+// Values read with a G-query are kept for their entry's ttl (ms) so that
+// repeated getter calls don't go back to the module. Setters issued
+// through the library write through, reboot() and factoryReset() flush.
+
+// ttl applies to every entry not already given its own with cacheTTL(),
+// so the two can be called in either order
+void RN52::enableCache(unsigned long ttl)
 {
-  println("AT+");
-  delay(50);
+  for (uint8_t i = 0; i < RN52_CACHE_SIZE; i++)
+    if (!_cache[i].ownTTL)
+      _cache[i].ttl = ttl;
+  _cacheEnabled = true;
 }
 
-void RN52::prevTrack()
+void RN52::disableCache()
 {
+  _cacheEnabled = false;
+  flushCache();
+}
+
+void RN52::cacheTTL(char opcode, unsigned long ttl)
+{
+  CacheEntry *e = cacheEntry(opcode);
+  if (e)
+  {
+    e->ttl = ttl;
+    e->ownTTL = true;
+  }
+}
+
+void RN52::flushCache()
+{
+  for (uint8_t i = 0; i < RN52_CACHE_SIZE; i++)
+    _cache[i].valid = false;
+}
+
+RN52::CacheEntry *RN52::cacheEntry(char opcode)
+{
+  for (uint8_t i = 0; i < RN52_CACHE_SIZE; i++)
+    if (_cache[i].opcode == opcode)
+      return &_cache[i];
+  return NULL;
+}
+
+bool RN52::cacheGet(char opcode, int &value)
+{
+  if (!_cacheEnabled)
+    return false;
+  CacheEntry *e = cacheEntry(opcode);
+  if (!e || !e->valid)
+    return false;
+  if (millis() - e->stamp > e->ttl)
+  {
+    e->valid = false;
+    return false;
+  }
+  value = e->value;
+  return true;
+}
+
+void RN52::cachePut(char opcode, int value)
+{
+  if (!_cacheEnabled)
+    return;
+  CacheEntry *e = cacheEntry(opcode);
+  if (!e)
+    return;
+  e->value = value;
+  e->stamp = millis();
+  e->valid = true;
+}
+
+void RN52::cacheInvalidate(char opcode)
+{
+  CacheEntry *e = cacheEntry(opcode);
+  if (e)
+    e->valid = false;
+}
+#endif
+
+//
+// Command pacing
+//
+// Each command is bracketed by beginCommand()/endCommand(). Commands the
+// RN52 answers with AOK/ERR are paced by that answer alone. For the rest
+// we keep a minimum gap per opcode, which shrinks while the module keeps
+// up and grows whenever a late ERR or '?' shows it didn't.
+
+RN52::Pacing *RN52::pacing(const char *opcode)
+{
+  for (uint8_t i = 0; i < _pacingUsed; i++)
+    if (_pacing[i].opcode[0] == opcode[0] && _pacing[i].opcode[1] == opcode[1])
+      return &_pacing[i];
+
+  // Not seen before, take a free slot or else the oldest one
+  Pacing *p;
+  if (_pacingUsed < RN52_PACING_SIZE)
+    p = &_pacing[_pacingUsed++];
+  else
+  {
+    p = &_pacing[_pacingNext];
+    _pacingNext = (_pacingNext + 1) % RN52_PACING_SIZE;
+  }
+  if (p == _pacingLast)
+    _pacingLast = NULL;
+  p->opcode[0] = opcode[0];
+  p->opcode[1] = opcode[0] ? opcode[1] : 0;
+  p->gap = RN52_DEFAULT_GAP;
+  p->noAck = false;
+  return p;
+}
+
+// True once the gap owed to the last unacknowledged command has passed
+bool RN52::commandReady()
+{
+  return !_pacingLast || (!_pacingLast->noAck && !_blind) ||
+    millis() - _lastCommand >= _pacingLast->gap;
+}
+
+// Wait out the last command's gap and discard whatever it left behind,
+// learning from it on the way
+void RN52::settle()
+{
+#ifndef RN52_NO_METADATA
+  // A background AD reply still arriving would be drained here and its
+  // next line taken for our answer, so finish collecting it first. It is
+  // bounded by the reply's 500ms silence timeout.
+  while (_asyncActive)
+  {
+    collectMetaData();
+    if (_asyncActive)
+      idle();
+  }
+#endif
+
+  while (!commandReady())
+    idle();
+
+  uint32_t window = 0;
+  bool ok = false, err = false;
+  uint8_t chunk[16];
+  size_t got;
+  while ((got = read(chunk, sizeof(chunk))) > 0)
+  {
+    for (size_t i = 0; i < got; i++)
+    {
+      uint8_t c = chunk[i];
+      window = (window << 8) | c;
+      if ((window & 0xFFFFFF) == (((uint32_t)'A' << 16) | ('O' << 8) | 'K'))
+        ok = true;
+      else if (c == '?' || (window & 0xFFFFFF) == (((uint32_t)'E' << 16) | ('R' << 8) | 'R'))
+        err = true;
+    }
+  }
+  framingError(); // from a reply nobody reads any more
+
+  Pacing *p = _pacingLast;
+  if (!p || !p->noAck)
+    return;
+  if (ok)
+    p->noAck = false;    // it does acknowledge, just slowly
+  if (err)
+    p->gap = min(p->gap + p->gap / 4 + 1, RN52_MAX_GAP);
+  else if (p->gap > RN52_MIN_GAP)
+    p->gap--;
+}
+
+void RN52::beginCommand(const char *opcode)
+{
+  _commandStart = millis();
+  settle();
+  _blind = false;
+  _pacingCurrent = pacing(opcode);
+  RN52_TRACE(RN52_TRACE_COMMAND, opcode[0]);
+}
+
+// Returns false if the RN52 rejected the command
+bool RN52::endCommand()
+{
+  char line[8];
+  const char *answer = NULL;
+
+  if (!_pacingCurrent->noAck)
+  {
+    unsigned long start = millis();
+    // Skip anything that isn't an answer, such as our own echo
+    while (!answer && millis() - start < RN52_ACK_TIMEOUT)
+    {
+      if (readLine(line, sizeof(line), RN52_ACK_TIMEOUT) < 0)
+        break;
+      if (RN52IsAnswer(line))
+        answer = line;
+    }
+  }
+  return endCommand(answer);
+}
+
+// For a command whose reply the caller read itself, up to and including
+// answer, its AOK/ERR line, or NULL if none came
+bool RN52::endCommand(const char *answer)
+{
+  Pacing *p = _pacingCurrent;
+  bool ok = !answer || strcmp(answer, "AOK") == 0;
+  p->noAck = !answer;
+
+  _pacingLast = p;
+  _lastCommand = millis();
+  _pollInterval = RN52_POLL_MIN;  // the user is active, watch closely
+  _commandCount++;
+  _commandTime += _lastCommand - _commandStart;
+  return ok;
+}
+
+// The command went out while another module was listening, so its AOK
+// can't be read. Fall back to the opcode's gap before the next command.
+void RN52::endBlind()
+{
+  _pacingLast = _pacingCurrent;
+  _lastCommand = millis();
+  _blind = true;
+  _commandCount++;
+  _commandTime += _lastCommand - _commandStart;
+}
+
+//
+// Command queue
+//
+// queue() only stores the command, so it is safe from an interrupt. The
+// pointer is kept, not the text, so cmd must outlive the queue entry
+// (a string literal is ideal). Urgent commands are sent by update() or
+// at the next line boundary of a multi-line read, whichever comes first.
+
+bool RN52::queue(const char *cmd, uint8_t priority)
+{
+  CommandQueue &q = _lanes[priority == RN52_URGENT ? RN52_URGENT : RN52_NORMAL];
+  uint8_t next = (q.tail + 1) % RN52_QUEUE_SIZE;
+  if (next == q.head)
+    return false;
+  q.cmd[q.tail] = cmd;
+  q.queued[q.tail] = millis();
+  q.tail = next;
+  return true;
+}
+
+// Send the oldest command in a lane. Returns false if it was empty.
+bool RN52::sendQueued(uint8_t priority)
+{
+  CommandQueue &q = _lanes[priority];
+  if (q.head == q.tail)
+    return false;
+
+  const char *cmd = q.cmd[q.head];
+  beginCommand(cmd);
+  println(cmd);
+  endCommand();
+
+  // Keep the position estimate in step, as playPause() etc. would
+  if (cmd[0] == 'A' && cmd[1] == 'P')
+    anchorPosition(trackPosition(), !_playing);
+  else if (cmd[0] == 'A' && cmd[1] == 'T')
+    anchorPosition(0, _playing);
+
+  if (priority == RN52_URGENT)
+  {
+    _urgentLatency = millis() - q.queued[q.head];
+    if (_urgentLatency > _urgentLatencyMax)
+      _urgentLatencyMax = _urgentLatency;
+  }
+  q.head = (q.head + 1) % RN52_QUEUE_SIZE;
+  return true;
+}
+
+// Called by a multi-line read that stopped at a line boundary because an
+// urgent command is waiting. Lets the rest of the abandoned reply run
+// out, sends the urgent commands and returns true so the read restarts.
+bool RN52::preempt()
+{
+  unsigned long quiet = millis();
+  while (millis() - quiet < RN52_QUIET)
+  {
+    if (available() > 0)
+    {
+      read();
+      quiet = millis();
+    }
+    else
+      idle();
+  }
+  while (sendQueued(RN52_URGENT));
+  return true;
+}
+
+// Commands per second achieved while commands were actually being sent
+unsigned long RN52::commandRate()
+{
+  if (_commandTime == 0)
+    return 0;
+  return _commandCount * 1000 / _commandTime;
+}
+
+#ifndef RN52_NO_CONFIG
+//
+// Settings snapshot
+//
+// saveSnapshot() mirrors the cached settings to EEPROM. At the next power
+// up restoreSnapshot() loads them straight into the cache, so the getters
+// answer without a round trip, and update() then checks them against the
+// module one at a time when it has nothing better to do. If any differ,
+// say because the module was factory reset, the mirror is re-synced from
+// the module and snapshotStale() tells the sketch to reconfigure it.
+
+uint16_t RN52::snapshotCRC(const Snapshot &snapshot)
+{
+  uint16_t crc = 0xFFFF;
+  const uint8_t *p = (const uint8_t *)&snapshot;
+  for (uint8_t i = 0; i < offsetof(Snapshot, crc); i++)
+    crc = _crc_ccitt_update(crc, p[i]);
+  return crc;
+}
+
+// The snapshot is loaded into the read cache, so it needs enableCache()
+// first and returns false without it. Restored values expire with the
+// ttls the sketch chose, verification doesn't depend on them.
+bool RN52::restoreSnapshot()
+{
+  if (!_cacheEnabled)
+    return false;
+
+  Snapshot s;
+  eeprom_read_block(&s, (const void *)RN52_EEPROM_SNAPSHOT, sizeof(s));
+  if (s.version != RN52_SNAPSHOT_VERSION || s.crc != snapshotCRC(s))
+    return false;
+
+  s.name[RN52_NAME_MAX] = 0;
+  strcpy(_cachedName, s.name);
+  cachePut('N', 0);
+  cachePut('%', s.extFeatures);
+  cachePut('|', s.audioRouting);
+  cachePut('^', s.idlePowerDown);
+  cachePut('S', s.startupVolume);
+  _snapshotUnverified = (1 << RN52_CACHE_SIZE) - 1;
+  _snapshotStale = false;
+  return true;
+}
+
+// Returns false, leaving the EEPROM alone, unless every setting could be
+// read, so a query that went unanswered is never stored as a value
+bool RN52::saveSnapshot()
+{
+  Snapshot s;
+  memset(&s, 0, sizeof(s));
+  s.version = RN52_SNAPSHOT_VERSION;
+  if (!getName(s.name, sizeof(s.name)) ||
+      !getExtFeatures(s.extFeatures) ||
+      !getAudioRouting(s.audioRouting) ||
+      !getIdlePowerDownTime(s.idlePowerDown) ||
+      !getVolumeOnStartup(s.startupVolume))
+    return false;
+  s.crc = snapshotCRC(s);
+  eeprom_update_block(&s, (void *)RN52_EEPROM_SNAPSHOT, sizeof(s));
+  return true;
+}
+
+// Check one restored value against the module
+void RN52::verifySnapshot()
+{
+  uint8_t i = 0;
+  while (!(_snapshotUnverified & (1 << i)))
+    i++;
+  _snapshotUnverified &= ~(1 << i);
+
+  CacheEntry &e = _cache[i];
+  int restored = e.value;
+  char restoredName[RN52_NAME_MAX + 1];
+  strcpy(restoredName, _cachedName);
+  char currentName[RN52_NAME_MAX + 1];
+  short current;
+  int value;
+  bool read;
+  e.valid = false;
+  switch (e.opcode)
+  {
+    case 'N': read = getName(currentName, sizeof(currentName)); break;
+    case '%': read = getExtFeatures(current); value = current; break;
+    case '|': read = getAudioRouting(current); value = current; break;
+    case '^': read = getIdlePowerDownTime(value); break;
+    default:  read = getVolumeOnStartup(value); break;
+  }
+  if (!read)
+  {
+    // No answer proves nothing, try again later
+    _snapshotUnverified |= 1 << i;
+    return;
+  }
+
+  bool same = e.opcode == 'N' ? strcmp(currentName, restoredName) == 0 : value == restored;
+  if (!same)
+    _snapshotStale = true;
+  // The cache now holds what the module really has. If the module went
+  // quiet while it was read back, check this entry again and retry then.
+  if (_snapshotUnverified == 0 && _snapshotStale && !saveSnapshot())
+    _snapshotUnverified |= 1 << i;
+}
+#endif
+
+// Wait until the RN52 accepts commands, either because it printed its
+// "CMD" banner or because it answered one of our probes. Returns false
+// if it stayed silent for timeout ms.
+bool RN52::waitReady(unsigned long timeout)
+{
+  char line[8];
+  int n = 0;
+  bool probed = false;
+  unsigned long start = millis();
+  unsigned long lastProbe = start;
+
+  while (millis() - start < timeout)
+  {
+    // G% is harmless and, unlike Q, doesn't clear any event bits
+    if (millis() - lastProbe >= RN52_READY_PROBE)
+    {
+      println("G%");
+      lastProbe = millis();
+      probed = true;
+    }
+
+    if (available() == 0)
+    {
+      idle();
+      continue;
+    }
+    char c = read();
+    if (c == '\r')
+      continue;
+    if (c != '\n')
+    {
+      if (n < (int)sizeof(line) - 1)
+        line[n++] = c;
+      continue;
+    }
+
+    line[n] = 0;
+    n = 0;
+    // "Reboot" is the old firmware saying goodbye, not the new one hello
+    if (line[0] == 0 || strcmp(line, "Reboot") == 0)
+      continue;
+
+    // The banner may overtake the answer to a probe sent just before it,
+    // swallow that answer so it can't be mistaken for the next reply
+    if (probed && strcmp(line, "CMD") == 0)
+      readLine(line, sizeof(line), RN52_READY_PROBE);
+
+    _bootTime = millis() - start;
+    return true;
+  }
+  return false;
+}
+
+#ifndef RN52_NO_GPIO
+//For use with the GPIO on the rn52, sets inputs and outputs
+bool RN52::GPIOPinMode(int pin, bool state)
+{
+  if (state) IO = IO | (1 << pin);
+  else {
+    short mask = 65535 ^ (1 << pin);
+    IO = IO & mask;
+  }
+  short toWrite = (IO | IOMask) & IOProtect;
+  beginCommand("I@");
+  print("I@,");
+  printHex(toWrite);
+  return endCommand();
+}
+
+//Writes outputs high or low, if inputs enables/disables internal pullup
+void RN52::GPIODigitalWrite(int pin, bool state)
+{
+  if (state) IOState = IOState | (1 << pin);
+  else {
+    short mask = 65535 ^ (1 << pin);
+    IOState = IOState & mask;
+  }
+  short toWrite = (IOState | IOStateMask) & IOStateProtect;
+  beginCommand("I&");
+  print("I&,");
+  printHex(toWrite);
+  endCommand();
+}
+
+//reads back the current state of the GPIO
+bool RN52::GPIODigitalRead(int pin)
+{
+  short valueIn = 0;
+  queryHex("I&", valueIn);
+  return (valueIn & (1 << pin)) >> pin;
+}
+
+//reads back which GPIO are currently set as outputs, 0 if it can't
+short RN52::GPIODirection()
+{
+  short direction = 0;
+  GPIODirection(direction);
+  return direction;
+}
+
+// As above, but returns false if the module didn't answer
+bool RN52::GPIODirection(short &direction)
+{
+  return queryHex("I@", direction);
+}
+#endif
+
+void RN52::setDiscoverability(bool discoverable)
+{
+  beginCommand("@,");
+  print("@,");
+  println(discoverable);
+  endCommand();
+}
+
+void RN52::toggleEcho()
+{
+  beginCommand("+");
+  println("+");
+  endCommand();
+}
+
+#ifndef RN52_NO_CONFIG
+void RN52::name(String nom, bool normalized)
+{
+  beginCommand("SN");
+  print("S");
+  if (normalized) print("-,");
+  else print("N,");
+  println(nom);
+  endCommand();
+
+  // A normalized name gets a MAC suffix we can't predict
+  if (normalized || nom.length() > RN52_NAME_MAX)
+    cacheInvalidate('N');
+  else
+  {
+    nom.toCharArray(_cachedName, sizeof(_cachedName));
+    cachePut('N', 0);
+  }
+}
+
+String RN52::name(void)
+{
+  char nom[RN52_NAME_MAX + 1] = "";
+  getName(nom, sizeof(nom));
+  return String(nom);
+}
+
+// As above, into nom, but returns false, leaving nom alone, if the
+// module didn't answer, so an unanswered query can't pass for no name
+bool RN52::getName(char *nom, size_t len)
+{
+  int unused;
+  if (!cacheGet('N', unused))
+  {
+    char line[RN52_NAME_MAX + 1];
+    if (!query("GN", line, sizeof(line)))
+      return false;
+    strcpy(_cachedName, line);
+    cachePut('N', 0);
+  }
+  strncpy(nom, _cachedName, len - 1);
+  nom[len - 1] = 0;
+  return true;
+}
+#endif
+
+void RN52::factoryReset()
+{
+  beginCommand("SF");
+  println("SF,1");
+  endCommand();
+#ifndef RN52_NO_CONFIG
+  flushCache();
+#endif
+}
+
+#ifndef RN52_NO_CONFIG
+int RN52::idlePowerDownTime(void)
+{
+  int timer = 0;
+  getIdlePowerDownTime(timer);
+  return timer;
+}
+
+// As above, but returns false, leaving timer alone, if the module didn't
+// answer
+bool RN52::getIdlePowerDownTime(int &timer)
+{
+  if (cacheGet('^', timer))
+    return true;
+
+  char line[8];
+  if (!query("G^", line, sizeof(line)))
+    return false;
+  timer = strtol(line, NULL, 10);
+  cachePut('^', timer);
+  return true;
+}
+
+void RN52::idlePowerDownTime(int timer)
+{
+  beginCommand("S^");
+  print("S^,");
+  println(timer);
+  endCommand();
+  cachePut('^', timer);
+}
+#endif
+
+void RN52::reboot()
+{
+  char line[8];
+  unsigned long start = millis();
+#ifndef RN52_NO_CONFIG
+  flushCache();
+#endif
+  settle();
+  println("R,1");
+  // Don't start probing until the old firmware has acknowledged, or it
+  // may answer the probe itself on its way down
+  readLine(line, sizeof(line), RN52_READY_PROBE);
+  if (waitReady())
+    _bootTime = millis() - start;
+}
+
+void RN52::call(String number)
+{
+  beginCommand("A,");
+  print("A,");
+  println(number);
+  endCommand();
+}
+
+void RN52::endCall()
+{
+  beginCommand("E");
+  println("E");
+  endCommand();
+}
+
+//
+// Incoming calls
+//
+// update() reads the event register whenever the RN52 pulls its event
+// pin (GPIO2) low, or when the poll interval runs out, and turns call
+// state transitions into ring/answer/hang-up callbacks.
+//
+// The poll interval doubles every time the status comes back unchanged,
+// up to RN52_POLL_MAX (RN52_POLL_CALL_MAX when only polling can catch a
+// call), and drops back to RN52_POLL_MIN on any change or
+// command. While update() keeps polling, isConnected() and trackChanged()
+// answer from the last poll instead of sending their own Q.
+//
+// callLatency() counts from when update() first saw the event pin go low
+// or, without the pin, from the poll before the one that saw the change,
+// since the event may have been waiting all that time.
+
+void RN52::eventPin(uint8_t pin)
+{
+  _eventPin = pin;
+  pinMode(pin, INPUT_PULLUP);
+}
+
+void RN52::answerCall()
+{
+  beginCommand("C");
+  println("C");
+  endCommand();
+}
+
+void RN52::rejectCall()
+{
+  endCall();
+}
+
+bool RN52::inCall(uint8_t state)
+{
+  return (state >= RN52_STATE_OUTGOING_CALL && state <= RN52_STATE_ACTIVE_CALL) ||
+    (state >= RN52_STATE_CALL_WAITING && state <= RN52_STATE_ACTIVE_CALL_HF);
+}
+
+void RN52::pollStatus()
+{
+#ifndef RN52_NO_CALLS
+  unsigned long start = _eventSeen ? _eventSeen : _lastPoll;
+#endif
+  _eventSeen = 0;
+  _lastPoll = millis();
+
+  // An unanswered poll says nothing about the module, so keep what the
+  // last one saw rather than read it as everything going idle, and try
+  // again when the interval is up (or the event pin is seen again)
+  Status was = _status;
+  if (!status(_status))
+    return;
+
+  if (_status.trackChanged)
+    _skipLanded = true;
+
+  // Without the event pin, polling is all that notices a call, so keep
+  // it quick while the sketch listens for calls or one is under way
+  unsigned long ceiling = RN52_POLL_MAX;
+#ifndef RN52_NO_CALLS
+  if (_eventPin == 0xFF &&
+      (_onRing || _onAnswer || _onHangUp || inCall(_status.state)))
+    ceiling = RN52_POLL_CALL_MAX;
+#endif
+
+  if (RN52CompareStatus(was, _status))
+    _pollInterval = RN52_POLL_MIN;
+  else
+    _pollInterval = min(_pollInterval * 2, ceiling);
+
+#ifndef RN52_NO_CONNECTION
+  if (!was.connected() && _status.connected())
+  {
+    // Time from power up, which is what the user waits through
+    if (_reconnectStart)
+    {
+      _connectTime = millis();
+      _reconnectStart = 0;
+      RN52_TRACE(RN52_TRACE_RECONNECT, 1);
+    }
+    _connectPending = true;
+  }
+  else if (was.connected() && !_status.connected())
+  {
+    _connectPending = false;
+    _friendlyName[0] = 0;
+  }
+#endif
+
+#ifndef RN52_NO_CALLS
+  // Fetch the caller before announcing the ring, so the callback has it
+  if (_status.callerID)
+    fetchCallerID();
+
+  if (was.state == _status.state)
+    return;
+
+  RN52CallCallback callback = NULL;
+  bool ended = false;
+  if (_status.state == RN52_STATE_INCOMING_CALL)
+    callback = _onRing;
+  else if ((was.state == RN52_STATE_INCOMING_CALL || was.state == RN52_STATE_OUTGOING_CALL) &&
+      (_status.state == RN52_STATE_ACTIVE_CALL || _status.state == RN52_STATE_ACTIVE_CALL_HF))
+    callback = _onAnswer;
+  else if (inCall(was.state) && !inCall(_status.state))
+  {
+    callback = _onHangUp;
+    ended = true;
+  }
+
+  if (callback)
+  {
+    _callLatency = millis() - start;
+    callback(_callerID);
+  }
+  if (ended)
+    _callerID[0] = 0;
+#endif
+}
+
+#ifndef RN52_NO_CALLS
+// Read the caller ID with T. The number is kept, or the name if the phone
+// withheld the number, truncated to RN52_CALLER_ID_MAX.
+void RN52::fetchCallerID()
+{
+  char line[RN52_CALLER_ID_MAX];
+  char number[RN52_CALLER_ID_MAX] = "";
+  char name[RN52_CALLER_ID_MAX] = "";
+
+  const char *answer = NULL;
+  beginCommand("T");
+  println("T");
+  for (uint8_t i = 0; !answer && i < 4 && readLine(line, sizeof(line), 200) >= 0; i++)
+  {
+    const char *eq = strchr(line, '=');
+    if (RN52IsAnswer(line))
+      answer = line;
+    else if (strncmp(line, "Name=", 5) == 0)
+      strcpy(name, line + 5);
+    else if (eq)
+      strcpy(number, eq + 1);
+    else if (line[0])
+      strcpy(number, line);
+  }
+  endCommand(answer);
+
+  strcpy(_callerID, number[0] ? number : name);
+}
+#endif
+
+void RN52::playPause()
+{
+  beginCommand("AP");
+  println("AP");
+  endCommand();
+  anchorPosition(trackPosition(), !_playing);
+}
+
+void RN52::nextTrack()
+{
+  beginCommand("AT");
+  println("AT+");
+  endCommand();
+  anchorPosition(0, _playing);
+}
+
+void RN52::prevTrack()
+{
+  beginCommand("AT");
   println("AT-");
-  delay(50);
+  endCommand();
+  anchorPosition(0, _playing);
+}
+
+//
+// Playback position
+//
+// The RN52 only reports the track length, so the position is
+// interpolated with millis() from the last play/pause or track change
+// we saw, rather than polled.
+
+void RN52::anchorPosition(unsigned long position, bool playing)
+{
+  _anchorPosition = position;
+  _anchorTime = millis();
+  _playing = playing;
+}
+
+unsigned long RN52::trackPosition()
+{
+  unsigned long position = _anchorPosition;
+  if (_playing)
+    position += millis() - _anchorTime;
+  if (_trackLength && position > _trackLength)
+    position = _trackLength;
+  return position;
 }
 
+// Position as a percentage of the track length, 0 if it isn't known yet
+uint8_t RN52::trackProgress()
+{
+  if (_trackLength < 10)
+    return 0;
+  // in 10ms units so a multi-hour track can't overflow the multiply
+  return (trackPosition() / 10) * 100 / (_trackLength / 10);
+}
+
+#ifndef RN52_NO_METADATA
 //Credit to Greg Shuttleworth for assistance on this function
 String RN52::getMetaData()
 {
-  while (available() > 0)
+  String metaData;
+  bool cut;
+  uint8_t attempts = 0;
+  do
   {
-    char c = read();
-  }
+    settle();
+    println("AD");
+    metaData = "";
+    cut = false;
+    int i = 8;
+    long count = millis();
+    while (i != 0 && !cut)
+    {
+      // A line, or as much of one as has arrived, at a time
+      char chunk[17];
+      size_t got = readUntil('\n', chunk, sizeof(chunk) - 1);
+      if (got > 0)
+      {
+        chunk[got] = 0;
+        count = millis();
+        metaData += chunk;
+        if (chunk[got - 1] == '\n')
+        {
+          i--;
+          cut = urgentPending();
+        }
+      }
+      else
+        idle();
+      if ((millis() - count) > 500) i--;
+    }
+  } while ((cut && preempt()) ||
+           (framingError() && ++attempts < RN52_QUERY_RETRIES));
+
+  int n = metaData.indexOf("Time(ms)=");
+  if (n != -1)
+    _trackLength = metaData.substring(n + 9).toInt();
+
+  return metaData;
+}
+
+// Request the metadata and hand each field to the onMetaData() callback
+// as soon as its line is complete, rather than buffering the whole reply.
+// Only one line is held at a time; values longer than RN52_META_LINE are
+// truncated. Returns the number of fields received.
+uint8_t RN52::streamMetaData()
+{
+  char line[RN52_META_LINE];
+  uint8_t count;
+  uint8_t attempts = 0;
+
+retry:
+  _metaSeen = count = 0;
+  settle();
   println("AD");
-  while (available() == 0);
-  String metaData;
-  int i = 8;
-  long count;
-  while (i != 0)
+  for (uint8_t i = 8; i > 0; --i)
   {
-    if (available() > 0)
+    // Give up on 500ms of silence, as getMetaData() does
+    if (readLine(line, sizeof(line), 500) < 0)
+      break;
+
+    // Fields already delivered are delivered again after the retry
+    if (urgentPending() && preempt())
+      goto retry;
+    if (framingError())
     {
-      char c = read();
-      count = millis();
-      metaData += c;
-      if (c == '\n') i--;
+      if (++attempts < RN52_QUERY_RETRIES)
+        goto retry;
+      break;
     }
-    if ((millis() - count) > 500) i--;
+
+    if (!metaDataLine(line))
+      continue;
+    count++;
+
+    // Every field is in, don't wait out the rest of the reply
+    if (_metaSeen == (1 << RN52_META_FIELDS) - 1)
+      break;
   }
-  return metaData;
+  return count;
+}
+
+// Hand one line of the AD reply to the callback, if it is a field.
+// Returns false if it wasn't.
+bool RN52::metaDataLine(const char *line)
+{
+  const char *value;
+  uint8_t field = RN52MetaDataField(line, &value);
+  if (field == RN52_META_FIELDS)
+    return false;
+
+  _metaSeen |= 1 << field;
+  if (field == RN52_META_TIME)
+    _trackLength = strtoul(value, NULL, 10);
+  else if (field == RN52_META_TRACK_NUMBER)
+    _metaTrack = atoi(value);
+  else if (field == RN52_META_TRACK_COUNT)
+    _metaTracks = atoi(value);
+  if (_metaDataCallback)
+    _metaDataCallback(field, value);
+  return true;
+}
+
+// Send AD and return straight away. update() then collects the reply from
+// the receive buffer as it arrives, which the RX interrupt fills on its
+// own, and hands each field to the onMetaData() callback. Nothing blocks
+// for the length of the reply, unless another command is sent before it
+// is in, which then waits for it. Returns false if a request is already
+// in flight.
+bool RN52::requestMetaData()
+{
+  if (_asyncActive)
+    return false;
+
+  settle();
+  println("AD");
+  _metaSeen = 0;
+  _asyncLen = 0;
+  _asyncLines = 8;
+  _asyncLast = millis();
+  _asyncActive = true;
+  return true;
+}
+
+// Take whatever has arrived of the reply, without waiting for more
+void RN52::collectMetaData()
+{
+  while (_asyncActive && available() > 0)
+  {
+    _asyncLast = millis();
+    int n = _asyncLen;
+    bool complete = takeLine(_asyncLine, n, RN52_META_LINE);
+    _asyncLen = n;
+    if (!complete)
+      continue;
+
+    _asyncLen = 0;
+    if (!framingError()) // a damaged line is dropped, the field stays unseen
+      metaDataLine(_asyncLine);
+    if (--_asyncLines == 0 || _metaSeen == (1 << RN52_META_FIELDS) - 1)
+      _asyncActive = false;
+  }
+
+  // 500ms of silence ends it, as for getMetaData()
+  if (_asyncActive && millis() - _asyncLast > 500)
+    _asyncActive = false;
 }
 
 String RN52::trackTitle()
@@ -797,29 +2285,44 @@ int RN52::trackCount()
   }
   return trackCount;
 }
+#endif
 
+#ifndef RN52_NO_CONNECTION
 String RN52::getConnectionData()
 {
-  while (available() > 0)
-  {
-    char c = read();
-  }
-  println("D");
-  while (available() == 0);
   String connectionData;
-  int i = 13;
-  long count;
-  while (i != 0)
+  bool cut;
+  uint8_t attempts = 0;
+  do
   {
-    if (available() > 0)
+    settle();
+    println("D");
+    connectionData = "";
+    cut = false;
+    int i = 13;
+    long count = millis();
+    while (i != 0 && !cut)
     {
-      char c = read();
-      count = millis();
-      connectionData += c;
-      if (c == '\n') i--;
+      // A line, or as much of one as has arrived, at a time
+      char chunk[17];
+      size_t got = readUntil('\n', chunk, sizeof(chunk) - 1);
+      if (got > 0)
+      {
+        chunk[got] = 0;
+        count = millis();
+        connectionData += chunk;
+        if (chunk[got - 1] == '\n')
+        {
+          i--;
+          cut = urgentPending();
+        }
+      }
+      else
+        idle();
+      if ((millis() - count) > 500) i--;
     }
-    if ((millis() - count) > 500) i--;
-  }
+  } while ((cut && preempt()) ||
+           (framingError() && ++attempts < RN52_QUERY_RETRIES));
   return connectionData;
 }
 
@@ -847,86 +2350,228 @@ String RN52::connectedMAC()
   return connectionData;
 }
 
-short RN52::getExtFeatures()
+//
+// Reconnecting
+//
+// The MAC of every device that connects is kept in EEPROM, so that at
+// power up reconnect() can page it straight away instead of waiting for
+// the phone or the module's own reconnect timing. update() falls back to
+// discoverable if it hasn't connected within the timeout.
+
+// The last device that connected, false if there never was one
+bool RN52::lastDevice(uint8_t *mac)
+{
+  uint8_t *addr = (uint8_t *)RN52_EEPROM_LAST_DEVICE;
+  if (eeprom_read_byte(addr) != RN52_EEPROM_MAGIC)
+    return false;
+  eeprom_read_block(mac, addr + 1, 6);
+  return true;
+}
+
+// Start paging the last device and return straight away, so the rest of
+// the start up can run while it connects. Don't reboot (or apply() a
+// profile that needs one) until it has.
+bool RN52::reconnect(unsigned long timeout)
 {
-  while (available() > 0)
+  uint8_t mac[6];
+  if (!lastDevice(mac))
+    return false;
+
+  beginCommand("B,");
+  print("B,");
+  for (uint8_t i = 0; i < 6; i++)
   {
-    char c = read();
+    if (mac[i] < 16) print("0");
+    print(mac[i], HEX);
   }
-  short valueIn = 0;
-  char c;
-  while (c != '\r')
+  println();
+  endCommand();
+
+  _reconnectStart = millis();
+  _reconnectTimeout = timeout;
+  RN52_TRACE(RN52_TRACE_RECONNECT, 0);
+  _connectTime = 0;
+  return true;
+}
+
+// Remember the device that just connected and apply its registry entry.
+// Run by update() as a step of its own, as it has to query the MAC.
+void RN52::deviceConnected()
+{
+  uint8_t mac[6];
+  String btac = connectedMAC();
+  if (!RN52ParseMAC(btac.c_str(), mac))
+    return;
+
+  // update, not write, so reconnecting to the same phone costs no wear
+  uint8_t *addr = (uint8_t *)RN52_EEPROM_LAST_DEVICE;
+  eeprom_update_byte(addr, RN52_EEPROM_MAGIC);
+  eeprom_update_block(mac, addr + 1, 6);
+
+  // Known device: pick up its name and preferences in one go
+  int8_t slot = findDevice(mac, false);
+  if (slot < 0)
   {
-    while (available() == 0) {
-      println("G%");
-      delay(50);
-    }
-    c = read();
-    if (c >= '0' && c <= '9')
-    {
-      valueIn *= 16;
-      valueIn += (c - '0');
-    }
-    else if (c >= 'A' && c <= 'F')
-    {
-      valueIn *= 16;
-      valueIn += (c - 'A') + 10;
-    }
-    else if ((c == '?') || (c == '!'))
+    _friendlyName[0] = 0;
+    return;
+  }
+  DeviceEntry *entry = deviceSlot(slot);
+  eeprom_read_block(_friendlyName, entry->name, RN52_FRIENDLY_MAX);
+  int8_t volume = (int8_t)eeprom_read_byte((uint8_t *)&entry->volume);
+  if (volume >= 0)
+    setVolume(volume);
+}
+
+//
+// Paired device registry
+//
+// Friendly names and per-device preferences live in an open addressing
+// table in EEPROM, hashed on the MAC, so a lookup on connect reads a
+// slot or two rather than scanning every entry. Freed slots are marked
+// deleted rather than emptied so later entries stay reachable.
+
+#define RN52_SLOT_EMPTY   0xFF // erased EEPROM
+#define RN52_SLOT_USED    0x01
+#define RN52_SLOT_DELETED 0x00
+
+RN52::DeviceEntry *RN52::deviceSlot(uint8_t slot)
+{
+  return (DeviceEntry *)(RN52_EEPROM_REGISTRY + slot * sizeof(DeviceEntry));
+}
+
+// Slot holding mac, or -1. With insert, the slot it should go in instead
+// (-1 if the table is full).
+int8_t RN52::findDevice(const uint8_t *mac, bool insert)
+{
+  // The last three bytes are per device, the first three per vendor
+  uint8_t start = (mac[3] ^ mac[4] ^ mac[5]) % RN52_REGISTRY_SLOTS;
+  int8_t free = -1;
+
+  for (uint8_t i = 0; i < RN52_REGISTRY_SLOTS; i++)
+  {
+    uint8_t slot = (start + i) % RN52_REGISTRY_SLOTS;
+    DeviceEntry *entry = deviceSlot(slot);
+    uint8_t state = eeprom_read_byte(&entry->state);
+
+    if (state == RN52_SLOT_USED)
     {
-      while (available() > 0)
-      {
-        char d = read();
-      }
+      uint8_t stored[6];
+      eeprom_read_block(stored, entry->mac, 6);
+      if (memcmp(stored, mac, 6) == 0)
+        return slot;
     }
+    else if (free < 0)
+      free = slot;
+
+    // Nothing was ever stored past an empty slot
+    if (state == RN52_SLOT_EMPTY)
+      break;
+  }
+  return insert ? free : -1;
+}
+
+// Add or update a device, mac given as the 12 hex digits of BTAC.
+// volume (0-15) is set whenever it connects, -1 leaves it alone.
+bool RN52::addDevice(const char *mac, const char *name, int8_t volume)
+{
+  uint8_t bytes[6];
+  if (!RN52ParseMAC(mac, bytes))
+    return false;
+  int8_t slot = findDevice(bytes, true);
+  if (slot < 0)
+    return false;
+
+  DeviceEntry entry;
+  entry.state = RN52_SLOT_USED;
+  memcpy(entry.mac, bytes, 6);
+  strncpy(entry.name, name, RN52_FRIENDLY_MAX - 1);
+  entry.name[RN52_FRIENDLY_MAX - 1] = 0;
+  entry.volume = volume;
+  eeprom_update_block(&entry, deviceSlot(slot), sizeof(entry));
+  return true;
+}
+
+bool RN52::removeDevice(const char *mac)
+{
+  uint8_t bytes[6];
+  if (!RN52ParseMAC(mac, bytes))
+    return false;
+  int8_t slot = findDevice(bytes, false);
+  if (slot < 0)
+    return false;
+  eeprom_update_byte(&deviceSlot(slot)->state, RN52_SLOT_DELETED);
+  return true;
+}
+
+void RN52::clearDevices()
+{
+  for (uint8_t i = 0; i < RN52_REGISTRY_SLOTS; i++)
+    eeprom_update_byte(&deviceSlot(i)->state, RN52_SLOT_EMPTY);
+}
+#endif
+
+#ifndef RN52_NO_CONFIG
+// The extended features, 0 if the module didn't answer
+short RN52::getExtFeatures()
+{
+  short features = 0;
+  getExtFeatures(features);
+  return features;
+}
+
+// As above, but returns false if the module didn't answer, so a read-
+// modify-write can tell "all bits clear" from "unknown"
+bool RN52::getExtFeatures(short &features)
+{
+  int cached;
+  if (cacheGet('%', cached))
+  {
+    features = cached;
+    return true;
   }
-  return valueIn;
+
+  if (!queryHex("G%", features))
+    return false;
+  cachePut('%', features);
+  return true;
 }
+#endif
 
 /* <EXPERIMENTAL Q Command Stuff> */
 
 short RN52::getEventReg()
 {
-  while (available() > 0)
-    char c = read();
-
   short valueIn = 0;
-  char c;
-
-  while (c != '\r')
-  {
-    while (available() == 0) {
-      println("Q");
-      delay(50);
-    }
-
-    c = read();
-
-    if (c >= '0' && c <= '9')
-    {
-      valueIn *= 16;
-      valueIn += (c - '0');
-    }
-    else if (c >= 'A' && c <= 'F')
-    {
-      valueIn *= 16;
-      valueIn += (c - 'A') + 10;
-    }
+  getEventReg(valueIn);
+  return valueIn;
+}
 
-    else if ((c == '?') || (c == '!'))
-    {
-      while (available() > 0)
-      {
-        char d = read();
-      }
-    }
-  }
+// Read the event register into reg. Returns false, leaving reg, the
+// latched track change and the position estimate alone, if the RN52
+// never answered.
+bool RN52::getEventReg(short &reg)
+{
+  short valueIn;
+  if (!queryHex("Q", valueIn))
+    return false;
 
   /* Record the track change internally */
   if(!_trackChanged && (valueIn & (1 << 13)))
+  {
 	  _trackChanged = true;
+	  RN52_TRACE(RN52_TRACE_TRACK_CHANGED, 0);
+  }
 
-  return valueIn;
+  /* Keep the position estimate in step: a new track starts from zero,
+     and connection state 13 means audio is streaming */
+  bool streaming = (valueIn & 0x000F) == 13;
+  if (valueIn & (1 << 13))
+    anchorPosition(0, streaming);
+  else if (streaming != _playing)
+    anchorPosition(trackPosition(), streaming);
+
+  reg = valueIn;
+  return true;
 }
 
 bool RN52::trackChanged(void)
@@ -939,6 +2584,10 @@ bool RN52::trackChanged(void)
 		return true;
 	}
 
+	/* update() is polling and would have latched a change already */
+	if(_lastPoll && millis() - _lastPoll < _pollInterval)
+		return false;
+
 	bool change = (getEventReg() & (1 << 13));
 	_trackChanged = false;
 	return change;
@@ -946,33 +2595,56 @@ bool RN52::trackChanged(void)
 
 bool RN52::isConnected(void)
 {
+	/* Share update()'s last poll while it is still current */
+	if(_lastPoll && millis() - _lastPoll < _pollInterval)
+		return _status.connected();
+
 	return (getEventReg() & 0x0F00);
 }
 
+RN52::Status RN52::status(void)
+{
+  return RN52DecodeStatus(getEventReg());
+}
+
+// Returns false, leaving s alone, if the RN52 never answered
+bool RN52::status(Status &s)
+{
+  short reg;
+  if (!getEventReg(reg))
+    return false;
+  s = RN52DecodeStatus(reg);
+  return true;
+}
+
 /* </EXPERIMENTAL Q Command Stuff> */
 
-void RN52::setExtFeatures(bool state, int bit)
+#ifndef RN52_NO_CONFIG
+// Set or clear one feature bit. Returns false, writing nothing, if the
+// current features couldn't be read.
+bool RN52::setExtFeatures(bool state, int bit)
 {
   short toWrite;
-  if (state) toWrite = getExtFeatures() | (1 << bit);
-  else toWrite = getExtFeatures() & (65535 ^ (1 << bit));
+  if (!getExtFeatures(toWrite))
+    return false;
+  if (state) toWrite = toWrite | (1 << bit);
+  else toWrite = toWrite & (65535 ^ (1 << bit));
+  beginCommand("S%");
   print("S%,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256)  print("0");
-  if (toWrite < 16)   print("0");
-  println(toWrite, HEX);
-  delay(100);
+  printHex(toWrite);
+  endCommand();
+  cachePut('%', toWrite);
+  return true;
 }
 
 void RN52::setExtFeatures(short settings)
 {
   short toWrite = settings;
+  beginCommand("S%");
   print("S%,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256)  print("0");
-  if (toWrite < 16)   print("0");
-  println(toWrite, HEX);
-  delay(100);
+  printHex(toWrite);
+  endCommand();
+  cachePut('%', toWrite);
 }
 
 bool RN52::AVRCPButtons()
@@ -1097,80 +2769,411 @@ void RN52::autoAcceptPasskey(bool state)
 
 int RN52::volumeOnStartup(void)
 {
-  while (available() > 0)
-  {
-    char c = read();
-  }
-  println("GS");
-  delay(100);
   int vol = 0;
-  char c;
-  while (c != '\r')
-  {
-    while (available() == 0);
-    c = read();
-    if (c >= '0' && c <= '9')
-    {
-      vol *= 16;
-      vol += (c - '0');
-    }
-    else if (c >= 'A' && c <= 'F')
-    {
-      vol *= 16;
-      vol += (c - 'A') + 10;
-    }
-  }
+  getVolumeOnStartup(vol);
   return vol;
 }
 
+// As above, but returns false, leaving vol alone, if the module didn't
+// answer
+bool RN52::getVolumeOnStartup(int &vol)
+{
+  if (cacheGet('S', vol))
+    return true;
+
+  char line[8];
+  if (!query("GS", line, sizeof(line)))
+    return false;
+  vol = RN52ParseHex(line);
+  cachePut('S', vol);
+  return true;
+}
+
 void RN52::volumeOnStartup(int vol)
 {
+  beginCommand("SS");
   print("SS,");
   print("0");
   println(vol, HEX);
-  delay(50);
+  endCommand();
+  cachePut('S', vol);
+}
+
+// Bring the module in line with profile, writing only the settings that
+// differ from what it already holds. Settings only take effect after a
+// reboot, so reboot if (and only if) one of those changed. Returns the
+// RN52_PROFILE_* fields that were written.
+uint8_t RN52::apply(const Profile &profile)
+{
+  uint8_t changed = 0;
+  uint8_t f = profile.fields;
+
+  // A setting that can't be read is left alone rather than guessed at
+  char currentName[RN52_NAME_MAX + 1];
+  if ((f & RN52_PROFILE_NAME) && profile.name && getName(currentName, sizeof(currentName)))
+  {
+    String current = currentName;
+    int len = strlen(profile.name);
+    // A normalized name comes back with "-" and the last 4 MAC digits
+    bool same = profile.normalized ?
+      (current.length() == (unsigned)len + 5 && current.startsWith(profile.name) && current[len] == '-') :
+      current.equals(profile.name);
+    if (!same)
+    {
+      name(profile.name, profile.normalized);
+      changed |= RN52_PROFILE_NAME;
+    }
+  }
+
+  short current;
+  if ((f & RN52_PROFILE_EXT_FEATURES) && getExtFeatures(current) &&
+      current != profile.extFeatures)
+  {
+    setExtFeatures(profile.extFeatures);
+    changed |= RN52_PROFILE_EXT_FEATURES;
+  }
+
+  if ((f & RN52_PROFILE_AUDIO_ROUTING) && getAudioRouting(current) &&
+      current != profile.audioRouting)
+  {
+    setAudioRouting(profile.audioRouting);
+    changed |= RN52_PROFILE_AUDIO_ROUTING;
+  }
+
+  int value;
+  if ((f & RN52_PROFILE_IDLE_POWERDOWN) && getIdlePowerDownTime(value) &&
+      value != profile.idlePowerDown)
+  {
+    idlePowerDownTime(profile.idlePowerDown);
+    changed |= RN52_PROFILE_IDLE_POWERDOWN;
+  }
+
+  if ((f & RN52_PROFILE_STARTUP_VOLUME) && getVolumeOnStartup(value) &&
+      value != profile.startupVolume)
+  {
+    volumeOnStartup(profile.startupVolume);
+    changed |= RN52_PROFILE_STARTUP_VOLUME;
+  }
+
+#ifndef RN52_NO_GPIO
+  // GPIO direction is live, it doesn't need a reboot
+  if (f & RN52_PROFILE_GPIO_DIRECTION)
+  {
+    short want = (profile.gpioDirection | IOMask) & IOProtect;
+    if (GPIODirection(current) && (current & IOProtect) != want)
+    {
+      IO = profile.gpioDirection;
+      beginCommand("I@");
+      print("I@,");
+      printHex(want);
+      endCommand();
+      changed |= RN52_PROFILE_GPIO_DIRECTION;
+    }
+  }
+#endif
+
+  if (changed & ~RN52_PROFILE_GPIO_DIRECTION)
+    reboot();
+
+  return changed;
 }
+#endif
 
 void RN52::volumeUp(void)
 {
+  beginCommand("AV");
   println("AV+");
-  delay(50);
+  endCommand();
+  if (_volume >= 0 && _volume < RN52_VOLUME_MAX) _volume++;
 }
 
 void RN52::volumeDown(void)
 {
+  beginCommand("AV");
   println("AV-");
-  delay(50);
+  endCommand();
+  if (_volume > 0) _volume--;
 }
 
-short RN52::getAudioRouting()
+//
+// Coalesced volume and skip steps
+//
+// volumeSteps() and skipTracks() only add to a net count, so they are
+// cheap enough to call from an encoder interrupt. update() must be called
+// from loop() and sends one step per call, as fast as the module takes them.
+
+void RN52::volumeSteps(int steps)
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  int net = constrain(_volumeSteps + steps, -RN52_VOLUME_MAX, RN52_VOLUME_MAX);
+  _volumeSteps = net;
+  _volumeTarget = -1;
+  SREG = oldSREG;
+}
+
+// Step to an absolute level. Until a level is known the volume is first
+// driven all the way down, which is the only way to learn it.
+void RN52::setVolume(uint8_t level)
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  _volumeTarget = min(level, RN52_VOLUME_MAX);
+  _volumeSteps = 0;
+  if (_volume < 0)
+    _volumeCalibrate = RN52_VOLUME_MAX + 1;
+  SREG = oldSREG;
+}
+
+void RN52::skipTracks(int tracks)
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  _skipSteps = constrain(_skipSteps + tracks, -100, 100);
+  SREG = oldSREG;
+}
+
+bool RN52::stepsPending()
+{
+  return _volumeSteps || _skipSteps || _volumeTarget >= 0 || _skipSent;
+}
+
+// Service every RN52 from one loop, one module per call. Only the
+// listening module can receive, so each is made to listen in turn, and
+// one with a reply still arriving keeps the line until it is done. Each
+// module keeps its own queues, timers and state in the meantime.
+void RN52::updateAll()
 {
-  while (available() > 0)
+#ifndef RN52_NO_METADATA
+  if (active_object && active_object->_asyncActive)
   {
-    char c = read();
+    active_object->update();
+    return;
   }
-  println("G|");
-  delay(100);
-  short routing = 0;
-  char c;
-  while (c != '\r')
+#endif
+
+  RN52 *next = _serviceNext ? _serviceNext : _instances;
+  if (!next)
+    return;
+  _serviceNext = next->_nextInstance;
+  next->listen();
+  next->update();
+}
+
+void RN52::update()
+{
+  // Note the edge now, the poll it triggers may have to wait its turn
+  if (_eventPin != 0xFF && !_eventSeen && digitalRead(_eventPin) == LOW)
+    _eventSeen = millis() | 1;
+#ifndef RN52_NO_METADATA
+  // A metadata reply in flight owns the link, unless something urgent
+  // needs it, in which case the request is sent again afterwards
+  if (_asyncActive)
+  {
+    if (!urgentPending())
+    {
+      collectMetaData();
+      return;
+    }
+    _asyncActive = false;
+    preempt();
+    requestMetaData();
+    return;
+  }
+#endif
+
+  if (!commandReady())
+    return;
+
+  // Urgent commands first, then status, then everything else
+  if (sendQueued(RN52_URGENT))
+    return;
+
+#ifndef RN52_NO_CONNECTION
+  if (_reconnectStart)
+  {
+    if (millis() - _reconnectStart > _reconnectTimeout)
+    {
+      _reconnectStart = 0;
+      RN52_TRACE(RN52_TRACE_RECONNECT, 2);
+      setDiscoverability(true);
+      return;
+    }
+    _pollInterval = RN52_POLL_MIN;
+  }
+#endif
+
+  if (_eventSeen || millis() - _lastPoll >= _pollInterval)
+  {
+    pollStatus();
+    return;
+  }
+
+#ifndef RN52_NO_CONNECTION
+  if (_connectPending)
+  {
+    _connectPending = false;
+    deviceConnected();
+    return;
+  }
+#endif
+
+  if (sendQueued(RN52_NORMAL))
+    return;
+
+  // Volume first, it's what the user hears change
+  int8_t dir = 0;
+  if (_volumeCalibrate)
+  {
+    dir = -1;
+    if (--_volumeCalibrate == 0)
+      _volume = 0;
+  }
+  else if (_volumeTarget >= 0)
+  {
+    if (_volumeTarget == _volume)
+      _volumeTarget = -1;
+    else
+      dir = _volumeTarget > _volume ? 1 : -1;
+  }
+  else if (_volumeSteps)
+  {
+    // volumeSteps() may be adding to it from an interrupt
+    uint8_t oldSREG = SREG;
+    cli();
+    if (_volumeSteps)
+    {
+      dir = _volumeSteps > 0 ? 1 : -1;
+      _volumeSteps -= dir;
+    }
+    SREG = oldSREG;
+  }
+
+  if (dir)
+  {
+    beginCommand("AV");
+    println(dir > 0 ? "AV+" : "AV-");
+    endCommand();
+    if (_volume >= 0)
+      _volume = constrain(_volume + dir, 0, RN52_VOLUME_MAX);
+    return;
+  }
+
+  if (_skipSteps)
   {
-    while (available() == 0);
-    c = read();
-    if (c >= '0' && c <= '9')
+#ifndef RN52_NO_METADATA
+    // Note the track the run starts from. The AD reply is collected at
+    // the top of update() like any requestMetaData(), so nothing blocks.
+    if (_verifySkips && _skipSent == 0 && _skipFrom == 0)
     {
-      routing *= 16;
-      routing += (c - '0');
+      if (!_skipAsked)
+      {
+        _skipAsked = requestMetaData();
+        return;
+      }
+      _skipAsked = false;
+      bool known = (_metaSeen & (1 << RN52_META_TRACK_NUMBER)) && _metaTrack > 0;
+      _skipFrom = known ? _metaTrack : -1;
     }
-    else if (c >= 'A' && c <= 'F')
+    // A reply asked for before this skip can't verify it
+    _skipAsked = false;
+#endif
+
+    uint8_t oldSREG = SREG;
+    cli();
+    dir = _skipSteps > 0 ? 1 : -1;
+    _skipSteps -= dir;
+    SREG = oldSREG;
+    _skipSent += dir;
+    beginCommand("AT");
+    println(dir > 0 ? "AT+" : "AT-");
+    endCommand();
+    anchorPosition(0, _playing);
+    _skipDone = millis();
+    _skipLanded = false;
+    return;
+  }
+
+  // All skips are out, check we landed where we meant to and make up
+  // the difference once if the phone dropped some
+  if (_skipSent)
+  {
+#ifndef RN52_NO_METADATA
+    if (_verifySkips && _skipFrom > 0)
     {
-      routing *= 16;
-      routing += (c - 'A') + 10;
+      // The phone updates TrackNumber some time after the AOK, so wait
+      // for it to report the track change (or give it RN52_SKIP_SETTLE)
+      if (!_skipLanded && millis() - _skipDone < RN52_SKIP_SETTLE)
+      {
+        _pollInterval = RN52_POLL_MIN;
+        return;
+      }
+      if (!_skipAsked)
+      {
+        _skipAsked = requestMetaData();
+        return;
+      }
+      _skipAsked = false;
+
+      const uint8_t both = (1 << RN52_META_TRACK_NUMBER) | (1 << RN52_META_TRACK_COUNT);
+      int want = _skipFrom + _skipSent;
+      if ((_metaSeen & both) == both && _metaTrack &&
+          want >= 1 && want <= _metaTracks && _metaTrack != want)
+      {
+        uint8_t oldSREG = SREG;
+        cli();
+        _skipSteps = constrain(_skipSteps + want - _metaTrack, -100, 100);
+        SREG = oldSREG;
+      }
     }
+#endif
+    // A correction isn't verified again, so we can't chase a moving target
+    _skipFrom = _skipSteps ? -1 : 0;
+    _skipSent = 0;
+    return;
   }
+
+#ifndef RN52_NO_CONFIG
+  // Nothing else to do, check a value restoreSnapshot() took on trust
+  if (_snapshotUnverified)
+    verifySnapshot();
+#endif
+}
+
+#ifndef RN52_NO_CONFIG
+// The audio routing register, 0 if the module didn't answer
+short RN52::getAudioRouting()
+{
+  short routing = 0;
+  getAudioRouting(routing);
   return routing;
 }
 
+// As above, but returns false if the module didn't answer
+bool RN52::getAudioRouting(short &routing)
+{
+  int cached;
+  if (cacheGet('|', cached))
+  {
+    routing = cached;
+    return true;
+  }
+
+  if (!queryHex("G|", routing))
+    return false;
+  cachePut('|', routing);
+  return true;
+}
+
+void RN52::setAudioRouting(short routing)
+{
+  beginCommand("S|");
+  print("S|,");
+  printHex(routing);
+  endCommand();
+  cachePut('|', routing);
+}
+
 int RN52::sampleWidth()
 {
   int width = (getAudioRouting() & 0x00F0) >> 4;
@@ -1179,14 +3182,16 @@ int RN52::sampleWidth()
 
 void RN52::sampleWidth(int width)
 {
-  short mask = getAudioRouting() & 0xFF0F;
+  short mask;
+  if (!getAudioRouting(mask))
+    return;
+  mask &= 0xFF0F;
   short toWrite = mask | (width << 4);
+  beginCommand("S|");
   print("S|,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256) print("0");
-  if (toWrite < 16) print("0");
-  println(toWrite, HEX);
-  delay(50);
+  printHex(toWrite);
+  endCommand();
+  cachePut('|', toWrite);
 }
 
 int RN52::sampleRate()
@@ -1197,14 +3202,16 @@ int RN52::sampleRate()
 
 void RN52::sampleRate(int rate)
 {
-  short mask = getAudioRouting() & 0xFFF0;
+  short mask;
+  if (!getAudioRouting(mask))
+    return;
+  mask &= 0xFFF0;
   short toWrite = mask | rate;
+  beginCommand("S|");
   print("S|,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256) print("0");
-  if (toWrite < 16) print("0");
-  println(toWrite, HEX);
-  delay(50);
+  printHex(toWrite);
+  endCommand();
+  cachePut('|', toWrite);
 }
 
 int RN52::A2DPRoute()
@@ -1215,12 +3222,149 @@ int RN52::A2DPRoute()
 
 void RN52::A2DPRoute(int route)
 {
-  short mask = getAudioRouting() & 0x00FF;
+  short mask;
+  if (!getAudioRouting(mask))
+    return;
+  mask &= 0x00FF;
   short toWrite = mask | (route << 8);
+  beginCommand("S|");
   print("S|,");
-  if (toWrite < 4096) print("0");
-  if (toWrite < 256) print("0");
-  if (toWrite < 16) print("0");
-  println(toWrite, HEX);
-  delay(50);
+  printHex(toWrite);
+  endCommand();
+  cachePut('|', toWrite);
+}
+#endif
+
+//
+// RN52Group
+//
+
+RN52Group::RN52Group() :
+  _count(0),
+  _skew(0),
+  _skewMax(0)
+{
+}
+
+bool RN52Group::add(RN52 &member)
+{
+  if (_count == RN52_GROUP_SIZE)
+    return false;
+  _members[_count++] = &member;
+  return true;
+}
+
+// Send cmd to every member. Returns false if it is too long to encode
+// or the listening member rejected it; the others' answers can't be read.
+bool RN52Group::send(const char *cmd)
+{
+  uint8_t line[RN52_GROUP_LINE];
+  size_t len = strlen(cmd);
+  if (len > RN52_GROUP_LINE - 2)
+    return false;
+  memcpy(line, cmd, len);
+  line[len++] = '\r';
+  line[len++] = '\n';
+
+  // Pacing first, so nothing waits once the bytes start going out
+  for (uint8_t m = 0; m < _count; m++)
+    _members[m]->beginCommand(cmd);
+
+  // The listening member goes last in every round: write() runs with
+  // interrupts off, and a write to another member after the listener's
+  // final byte could hide the start bit of its AOK
+  uint8_t order[RN52_GROUP_SIZE];
+  uint8_t n = 0;
+  RN52 *listener = 0;
+  for (uint8_t m = 0; m < _count; m++)
+  {
+    if (_members[m]->isListening())
+      listener = _members[m];
+    else
+      order[n++] = m;
+  }
+
+  // The modules act on the final byte, so that is what gets timed
+  unsigned long first = 0, last = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    for (uint8_t k = 0; k < n; k++)
+    {
+      _members[order[k]]->RN52::write(line[i]);
+      if (i == len - 1)
+      {
+        last = micros();
+        if (k == 0)
+          first = last;
+      }
+    }
+    if (listener)
+    {
+      listener->RN52::write(line[i]);
+      if (i == len - 1)
+      {
+        last = micros();
+        if (n == 0)
+          first = last;
+      }
+    }
+  }
+  _skew = last - first;
+  if (_skew > _skewMax)
+    _skewMax = _skew;
+
+  bool ok = true;
+  for (uint8_t m = 0; m < _count; m++)
+  {
+    RN52 *member = _members[m];
+    if (member->isListening())
+      ok = member->endCommand();
+    else
+      member->endBlind();
+  }
+  return ok;
+}
+
+void RN52Group::playPause()
+{
+  send("AP");
+  for (uint8_t m = 0; m < _count; m++)
+  {
+    RN52 *member = _members[m];
+    member->anchorPosition(member->trackPosition(), !member->_playing);
+  }
+}
+
+void RN52Group::nextTrack()
+{
+  send("AT+");
+  for (uint8_t m = 0; m < _count; m++)
+    _members[m]->anchorPosition(0, _members[m]->_playing);
+}
+
+void RN52Group::prevTrack()
+{
+  send("AT-");
+  for (uint8_t m = 0; m < _count; m++)
+    _members[m]->anchorPosition(0, _members[m]->_playing);
+}
+
+void RN52Group::volumeUp()
+{
+  send("AV+");
+  for (uint8_t m = 0; m < _count; m++)
+  {
+    RN52 *member = _members[m];
+    if (member->_volume >= 0 && member->_volume < RN52_VOLUME_MAX) member->_volume++;
+  }
+}
+
+void RN52Group::volumeDown()
+{
+  send("AV-");
+  for (uint8_t m = 0; m < _count; m++)
+  {
+    RN52 *member = _members[m];
+    if (member->_volume > 0) member->_volume--;
+  }
 }
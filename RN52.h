@@ -25,18 +25,212 @@
 
 #include <inttypes.h>
 #include <Stream.h>
+#include "RN52Parse.h"
 
 /******************************************************************************
 * Definitions
 ******************************************************************************/
 
+// Build settings. RN52.cpp is compiled on its own, without the sketch's
+// #defines, so the settings marked "build setting" below must be changed
+// by editing this file or with a global -D build flag. A #define in the
+// sketch is only seen by the sketch.
+
+// Parts of the library a sketch can leave out, to get back the RAM they
+// hold and the code update() pulls in (build settings):
+//   RN52_NO_METADATA    AD track metadata and its background collection
+//   RN52_NO_CONNECTION  D connection data, reconnect and the device registry
+//   RN52_NO_GPIO        the I@/I& GPIO commands
+//   RN52_NO_CONFIG      module settings, apply(), the read cache and the
+//                       EEPROM snapshot
+//   RN52_NO_CALLS       caller ID and the ring/answer/hang-up callbacks
+// #define RN52_NO_METADATA
+// #define RN52_NO_CONNECTION
+// #define RN52_NO_GPIO
+// #define RN52_NO_CONFIG
+// #define RN52_NO_CALLS
+//
+// What every RN52 object holds whatever the flags, on AVR, with the sizes
+// below: per opcode pacing ~55 bytes (RN52_PACING_SIZE), the command
+// lanes ~60 (RN52_QUEUE_SIZE), status polling ~23, volume and skip steps
+// ~15 and the playback position ~13. Call tracking adds ~34, 24 of them
+// the caller ID (RN52_CALLER_ID_MAX), unless built with RN52_NO_CALLS.
+
+// The flags change the layout of the class, so begin() is linked under a
+// name made from them. A sketch that sees other flags than RN52.cpp did
+// then fails to link, with an undefined RN52::begin_config..., instead
+// of corrupting memory.
+#define RN52_CAT_(a, b) a##b
+#define RN52_CAT(a, b) RN52_CAT_(a, b)
+#ifdef RN52_NO_METADATA
+#define RN52_CFG_METADATA _noMetadata
+#else
+#define RN52_CFG_METADATA
+#endif
+#ifdef RN52_NO_CONNECTION
+#define RN52_CFG_CONNECTION _noConnection
+#else
+#define RN52_CFG_CONNECTION
+#endif
+#ifdef RN52_NO_GPIO
+#define RN52_CFG_GPIO _noGPIO
+#else
+#define RN52_CFG_GPIO
+#endif
+#ifdef RN52_NO_CONFIG
+#define RN52_CFG_CONFIG _noConfig
+#else
+#define RN52_CFG_CONFIG
+#endif
+#ifdef RN52_NO_CALLS
+#define RN52_CFG_CALLS _noCalls
+#else
+#define RN52_CFG_CALLS
+#endif
+#define RN52_BEGIN RN52_CAT(RN52_CAT(RN52_CAT(RN52_CAT(RN52_CAT(begin_config, \
+  RN52_CFG_METADATA), RN52_CFG_CONNECTION), RN52_CFG_GPIO), RN52_CFG_CONFIG), RN52_CFG_CALLS)
+
 #define _SS_MAX_RX_BUFF 64 // RX buffer size
+#define RN52_READY_TIMEOUT 5000 // longest we wait for the RN52 to boot (ms)
+#define RN52_READY_PROBE 100 // interval between readiness probes (ms)
+#define RN52_REPLY_TIMEOUT 500 // longest wait for the answer to a query (ms)
+#define RN52_QUERY_RETRIES 3   // times a query is sent before giving up
+
+// Set to 1 to sample every bit three times and vote, and to check each
+// stop bit. Replies with a misframed byte are then read again. Build
+// setting, the class layout is the same either way.
+#ifndef RN52_RX_MAJORITY
+#define RN52_RX_MAJORITY 0
+#endif
+
+// Profile fields, used both to pick what apply() manages and to report
+// what it had to change
+#define RN52_PROFILE_NAME           0x01
+#define RN52_PROFILE_EXT_FEATURES   0x02
+#define RN52_PROFILE_AUDIO_ROUTING  0x04
+#define RN52_PROFILE_IDLE_POWERDOWN 0x08
+#define RN52_PROFILE_STARTUP_VOLUME 0x10
+#define RN52_PROFILE_GPIO_DIRECTION 0x20
+
+#define RN52_CACHE_SIZE 5 // G-queries that can be cached: N % | ^ S
+#define RN52_NAME_MAX 20  // longest device name the RN52 accepts
+
+// The metadata field ids, connection states and status fields are in
+// RN52Parse.h with the reply parsing that uses them
+#define RN52_META_LINE 64 // longest metadata line kept, including "Key="
+
+#define RN52_VOLUME_MAX 15 // AV+/AV- move between levels 0 and 15
+#define RN52_SKIP_SETTLE 1500 // longest wait for the phone to report a skip (ms)
+
+// Command pacing. Commands the RN52 acknowledges are paced by their AOK,
+// others by a gap learned per opcode.
+#define RN52_ACK_TIMEOUT 100 // longest wait for AOK/ERR before assuming none comes (ms)
+#define RN52_DEFAULT_GAP 50  // starting gap after an unacknowledged command (ms)
+#define RN52_MIN_GAP 5
+#define RN52_MAX_GAP 250
+#define RN52_PACING_SIZE 8   // opcodes whose pacing is remembered
+
+// Command queue lanes. Urgent commands jump ahead of normal ones and cut
+// into multi-line reads, which are then retried.
+#define RN52_URGENT 0
+#define RN52_NORMAL 1
+#define RN52_QUEUE_SIZE 4 // per lane, one slot is always kept free
+#define RN52_QUIET 20     // silence that marks the end of an abandoned reply (ms)
+
+#define RN52_POLL_MIN 100        // status poll interval right after a change (ms)
+#define RN52_POLL_MAX 3200       // status poll interval when nothing happens (ms)
+#define RN52_POLL_CALL_MAX 400   // the same without an event pin, while calls are watched (ms)
+#ifndef RN52_NO_CALLS
+#define RN52_CALLER_ID_MAX 24   // longest caller ID kept, including the name
+
+typedef void (*RN52CallCallback)(const char *callerID);
+#endif
+
+// EEPROM layout. To share the EEPROM with a sketch, move RN52_EEPROM_BASE
+// (build setting).
+#ifndef RN52_EEPROM_BASE
+#define RN52_EEPROM_BASE 0
+#endif
+#define RN52_EEPROM_LAST_DEVICE RN52_EEPROM_BASE // marker + 6 byte MAC
+#define RN52_EEPROM_REGISTRY (RN52_EEPROM_BASE + 7) // paired device table
+#define RN52_EEPROM_SNAPSHOT (RN52_EEPROM_REGISTRY + RN52_REGISTRY_SLOTS * RN52_DEVICE_ENTRY_SIZE) // settings mirror
+#define RN52_EEPROM_MAGIC 0x52
+#define RN52_SNAPSHOT_VERSION 1
+
+#define RN52_REGISTRY_SLOTS 8 // devices the registry can hold
+#define RN52_FRIENDLY_MAX 16  // longest friendly name, including the 0
+#define RN52_DEVICE_ENTRY_SIZE 24 // EEPROM bytes per registry slot
+
+#define RN52_RECONNECT_TIMEOUT 10000 // give up on the last device after (ms)
+
+#define RN52_GROUP_SIZE 4  // modules an RN52Group can hold
+#define RN52_GROUP_LINE 24 // longest command it broadcasts, including "\r\n"
+
+typedef void (*RN52MetaDataCallback)(uint8_t field, const char *value);
+
+// Traffic recorder, keeps the last RN52_RECORD_SIZE bytes sent and read
+// in a RAM ring. Leave at 0 to build without the recorder and replay.
+// Build setting.
+#ifndef RN52_RECORD_SIZE
+#define RN52_RECORD_SIZE 0
+#endif
+#define RN52_RECORD_TX        0x8000 // set in delta for bytes we sent
+#define RN52_RECORD_DELTA_MAX 0x7FFF // longer gaps are clipped (ms)
+
+// One recorded byte, delta is the time since the previous record (ms)
+struct RN52Record
+{
+  uint16_t delta;
+  uint8_t data;
+};
+
+// Event trace, the last RN52_TRACE_SIZE events with their micros() time.
+// Must be a power of two no larger than 128, 0 builds without tracing.
+// Build setting.
+#ifndef RN52_TRACE_SIZE
+#define RN52_TRACE_SIZE 0
+#endif
+#if RN52_TRACE_SIZE & (RN52_TRACE_SIZE - 1) || RN52_TRACE_SIZE > 128
+#error "RN52_TRACE_SIZE must be 0 or a power of two up to 128"
+#endif
+
+// Trace events, and what their arg holds
+#define RN52_TRACE_COMMAND       1 // command or query sent, its first letter
+#define RN52_TRACE_FIRST_BYTE    2 // first byte of a reply line, the byte
+#define RN52_TRACE_LAST_BYTE     3 // end of a reply line, its length
+#define RN52_TRACE_TIMEOUT       4 // no complete line in time, bytes kept
+#define RN52_TRACE_OVERFLOW      5 // receive buffer full, byte dropped (*)
+#define RN52_TRACE_TRACK_CHANGED 6 // track change latched from Q
+#define RN52_TRACE_RECONNECT     7 // 0 paging, 1 connected, 2 gave up
+#define RN52_TRACE_FRAMING       8 // stop bit missing, the byte (*)
+// (*) noted by the receive interrupt and traced, with the time, by the
+// next read, available() or peek(); repeats in between are traced once
 #ifndef GCC_VERSION
 #define GCC_VERSION (__GNUC__ * 10000 + __GNUC_MINOR__ * 100 + __GNUC_PATCHLEVEL__)
 #endif
 
 class RN52 : public Stream
 {
+public:
+#ifndef RN52_NO_CONFIG
+  // Desired module configuration for apply(). Only the fields selected
+  // in "fields" are read back and compared, the rest are left alone.
+  struct Profile
+  {
+    uint8_t fields;
+    const char *name;
+    bool normalized;
+    short extFeatures;
+    short audioRouting;
+    int idlePowerDown;
+    int startupVolume;
+    short gpioDirection;
+  };
+#endif
+
+  // The Q event register decoded, see RN52Parse.h
+  typedef RN52Status Status;
+
 private:
   // per object data
   uint8_t _receivePin;
@@ -52,22 +246,200 @@ private:
   uint16_t _rx_delay_intrabit;
   uint16_t _rx_delay_stopbit;
   uint16_t _tx_delay;
+  uint16_t _rx_delay_spread; // between the three samples of a bit
 
   uint16_t _buffer_overflow:1;
   uint16_t _inverse_logic:1;
+  volatile bool _framingError;     // only ever set with RN52_RX_MAJORITY
+  volatile uint16_t _framingErrors;
+
+  unsigned long _bootTime;
+
+#ifndef RN52_NO_GPIO
+  // this module's GPIO directions and states, as last written
+  short IO;
+  short IOState;
+#endif
+
+#ifndef RN52_NO_CONFIG
+  // read cache for G-queries, keyed by query opcode
+  struct CacheEntry
+  {
+    char opcode;
+    bool valid;
+    int value;
+    unsigned long stamp;
+    unsigned long ttl;
+    bool ownTTL; // set by cacheTTL(), enableCache() leaves it alone
+  };
+  CacheEntry _cache[RN52_CACHE_SIZE];
+  char _cachedName[RN52_NAME_MAX + 1];
+  bool _cacheEnabled;
+#endif
+
+#ifndef RN52_NO_METADATA
+  RN52MetaDataCallback _metaDataCallback;
+  uint8_t _metaSeen;
+  int _metaTrack;  // TrackNumber and TrackCount as last reported
+  int _metaTracks;
+
+  // metadata reply being collected by update(), see requestMetaData()
+  char _asyncLine[RN52_META_LINE];
+  uint8_t _asyncLen;
+  uint8_t _asyncLines;
+  unsigned long _asyncLast;
+  bool _asyncActive;
+#endif
+
+  // playback position estimate, anchored at the last known position
+  unsigned long _trackLength;
+  unsigned long _anchorPosition;
+  unsigned long _anchorTime;
+  bool _playing;
+
+  // volume and skip steps waiting to be drained by update()
+  volatile int8_t _volumeSteps;
+  volatile int8_t _skipSteps;
+  int8_t _volume;
+  int8_t _volumeTarget;
+  uint8_t _volumeCalibrate;
+  bool _verifySkips;
+  int _skipFrom;
+  int _skipSent;
+  unsigned long _skipDone; // when the last skip of a run was acknowledged
+  bool _skipLanded;        // a track change was seen since
+#ifndef RN52_NO_METADATA
+  bool _skipAsked;         // AD sent to check a skip run, reply not looked at
+#endif
+
+  // per opcode pacing, learned from the module's replies
+  struct Pacing
+  {
+    char opcode[2];
+    uint8_t gap;
+    bool noAck;
+  };
+  Pacing _pacing[RN52_PACING_SIZE];
+  uint8_t _pacingUsed;
+  uint8_t _pacingNext;
+  Pacing *_pacingCurrent;
+  Pacing *_pacingLast;
+  unsigned long _lastCommand;
+  bool _blind; // last command was sent while another module listened
+  unsigned long _commandStart;
+  unsigned long _commandCount;
+  unsigned long _commandTime;
+
+  // command lanes, each a single producer/single consumer ring so the
+  // urgent one may be filled from a button interrupt
+  struct CommandQueue
+  {
+    const char *cmd[RN52_QUEUE_SIZE];
+    unsigned long queued[RN52_QUEUE_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+  };
+  CommandQueue _lanes[2];
+  unsigned long _urgentLatency;
+  unsigned long _urgentLatencyMax;
+
+  // status polling, driven by update()
+  Status _status; // last status seen by update()
+  volatile bool _trackChanged; // latched by getEventReg() for trackChanged()
+  uint8_t _eventPin;
+  unsigned long _eventSeen; // when update() first saw the event pin low
+  unsigned long _lastPoll;
+  unsigned long _pollInterval;
+
+#ifndef RN52_NO_CALLS
+  // incoming call tracking
+  char _callerID[RN52_CALLER_ID_MAX];
+  RN52CallCallback _onRing;
+  RN52CallCallback _onAnswer;
+  RN52CallCallback _onHangUp;
+  unsigned long _callLatency;
+#endif
+
+  // MCU sleep while waiting on the module
+  bool _lowPower;
+  unsigned long _sleepTime;
+  unsigned long _sleepMicros;
+
+#ifndef RN52_NO_CONNECTION
+  // reconnect to the last device
+  unsigned long _reconnectStart;
+  unsigned long _reconnectTimeout;
+  unsigned long _connectTime;
+  bool _connectPending; // a poll saw a device connect, update() looks it up
+
+  // paired device registry, an open addressing hash table in EEPROM
+  struct DeviceEntry
+  {
+    uint8_t state;
+    uint8_t mac[6];
+    char name[RN52_FRIENDLY_MAX];
+    int8_t volume;
+  };
+  static_assert(sizeof(DeviceEntry) == RN52_DEVICE_ENTRY_SIZE,
+                "the registry would overlap the snapshot in EEPROM");
+  char _friendlyName[RN52_FRIENDLY_MAX];
+#endif
+
+#ifndef RN52_NO_CONFIG
+  // EEPROM mirror of the settings the cache holds
+  struct Snapshot
+  {
+    uint8_t version;
+    char name[RN52_NAME_MAX + 1];
+    short extFeatures;
+    short audioRouting;
+    int idlePowerDown;
+    int startupVolume;
+    uint16_t crc;
+  };
+  uint8_t _snapshotUnverified; // cache entries not yet checked, one bit each
+  bool _snapshotStale;
+#endif
 
   // static data
   static char _receive_buffer[_SS_MAX_RX_BUFF];
   static volatile uint8_t _receive_buffer_tail;
   static volatile uint8_t _receive_buffer_head;
-  static volatile bool _trackChanged;
   static RN52 *active_object;
+  static RN52 *_instances;      // every RN52, for updateAll()
+  static RN52 *_serviceNext;
+  RN52 *_nextInstance;
+#if RN52_RECORD_SIZE
+  static RN52Record _record[RN52_RECORD_SIZE];
+  static uint16_t _recordHead;
+  static uint16_t _recordCount;
+  static unsigned long _recordLast;
+  static bool _recording;
+  static const RN52Record *_replay;
+  static uint16_t _replayLeft;
+  static unsigned long _replayLast;
+  static uint16_t _replayMismatches;
+#endif
+#if RN52_TRACE_SIZE
+  struct TraceEntry
+  {
+    unsigned long time;
+    uint8_t event;
+    uint8_t arg;
+  };
+  static TraceEntry _trace[RN52_TRACE_SIZE];
+  static uint8_t _traceHead;
+  static uint8_t _traceCount;
+  static volatile uint8_t _traceReceived; // events recv() noted, one bit each
+  static volatile uint8_t _traceOverflowByte;
+  static volatile uint8_t _traceFramingByte;
+#endif
+#ifndef RN52_NO_GPIO
   static short IOMask;
   static short IOProtect;
   static short IOStateMask;
   static short IOStateProtect;
-  static short IO;
-  static short IOState;
+#endif
 
   // private methods
   void recv() __attribute__((__always_inline__));
@@ -76,6 +448,58 @@ private:
   void setTX(uint8_t transmitPin);
   void setRX(uint8_t receivePin);
   void setRxIntMsk(bool enable) __attribute__((__always_inline__));
+#if RN52_TRACE_SIZE
+  static void trace(uint8_t event, uint8_t arg);
+  static void traceReceived();
+#endif
+#if RN52_RECORD_SIZE
+  static void record(uint8_t data, bool tx);
+  void replayPump();
+  void replayNext();
+#endif
+  size_t take(uint8_t *dst, size_t size, int delim);
+  bool takeLine(char *buf, int &n, int len);
+  int readLine(char *buf, int len, unsigned long timeout);
+  bool framingError() { bool ret = _framingError; if (ret) _framingError = false; return ret; }
+  void idle();
+  bool query(const char *cmd, char *reply, int len);
+  bool queryHex(const char *cmd, short &value);
+  void printHex(short value);
+#ifndef RN52_NO_CONFIG
+  CacheEntry *cacheEntry(char opcode);
+  bool cacheGet(char opcode, int &value);
+  void cachePut(char opcode, int value);
+  void cacheInvalidate(char opcode);
+#endif
+#ifndef RN52_NO_METADATA
+  bool metaDataLine(const char *line);
+  void collectMetaData();
+#endif
+  void anchorPosition(unsigned long position, bool playing);
+  Pacing *pacing(const char *opcode);
+  bool commandReady();
+  void settle();
+  void beginCommand(const char *opcode);
+  bool endCommand();
+  bool endCommand(const char *answer);
+  void endBlind();
+  bool sendQueued(uint8_t priority);
+  bool urgentPending() { return _lanes[RN52_URGENT].head != _lanes[RN52_URGENT].tail; }
+  bool preempt();
+  void pollStatus();
+#ifndef RN52_NO_CALLS
+  void fetchCallerID();
+#endif
+  static bool inCall(uint8_t state);
+#ifndef RN52_NO_CONNECTION
+  void deviceConnected();
+  static DeviceEntry *deviceSlot(uint8_t slot);
+  static int8_t findDevice(const uint8_t *mac, bool insert);
+#endif
+#ifndef RN52_NO_CONFIG
+  static uint16_t snapshotCRC(const Snapshot &snapshot);
+  void verifySnapshot();
+#endif
 
   // Return num - sub, or 1 if the result would be < 1
   static uint16_t subtract_cap(uint16_t num, uint16_t sub);
@@ -83,6 +507,8 @@ private:
   // private static method for timing
   static inline void tunedDelay(uint16_t delay);
 
+  friend class RN52Group;
+
 
 
 public:
@@ -90,16 +516,21 @@ public:
   // public methods
   RN52(uint8_t receivePin, uint8_t transmitPin, bool inverse_logic = false);
   ~RN52();
-  void begin(long speed);
+  void begin(long speed) { RN52_BEGIN(speed); }
+  void RN52_BEGIN(long speed); // begin(), under the name RN52.cpp was built with
   bool listen();
   void end();
   bool isListening() { return this == active_object; }
   bool stopListening();
   bool overflow() { bool ret = _buffer_overflow; if (ret) _buffer_overflow = false; return ret; }
+  uint16_t framingErrors();
   int peek();
 
   virtual size_t write(uint8_t byte);
+  virtual size_t write(const uint8_t *buffer, size_t size);
   virtual int read();
+  size_t read(uint8_t *buffer, size_t size);
+  size_t readUntil(char delim, char *buffer, size_t size);
   virtual int available();
   virtual void flush();
   operator bool() { return true; }
@@ -108,26 +539,86 @@ public:
 
   static inline void handle_interrupt() __attribute__((__always_inline__));
 
+// Traffic recorder and replay, built when RN52_RECORD_SIZE is not 0
+#if RN52_RECORD_SIZE
+  void startRecording();
+  void stopRecording() { _recording = false; }
+  uint16_t recordCount() { return _recordCount; }
+  size_t dumpRecording(Print &out);
+  void replay(const RN52Record *records, uint16_t count);
+  bool replaying() { return _replayLeft != 0; }
+  uint16_t replayMismatches() { return _replayMismatches; }
+#endif
+
+// Event trace, built when RN52_TRACE_SIZE is not 0
+#if RN52_TRACE_SIZE
+  static uint8_t traceCount() { return _traceCount; }
+  static void clearTrace();
+  static size_t dumpTrace(Print &out);
+#endif
+
+#ifndef RN52_NO_GPIO
 // GPIO Commands
   bool GPIOPinMode(int pin, bool state);
   void GPIODigitalWrite(int pin, bool state);
   bool GPIODigitalRead(int pin);
+  short GPIODirection();
+  bool GPIODirection(short &direction);
+#endif
 
 // General Commands
   void reboot();
+  bool waitReady(unsigned long timeout = RN52_READY_TIMEOUT);
+  void lowPower(bool enable) { _lowPower = enable; }
+  unsigned long sleepTime() { return _sleepTime; }
+  unsigned long bootTime() { return _bootTime; }
   void setDiscoverability(bool discoverable);
   void toggleEcho();
   void factoryReset();
+  unsigned long commandRate();
+  void resetCommandStats() { _commandCount = _commandTime = 0; }
+#ifndef RN52_NO_CONFIG
   int idlePowerDownTime(void);
+  bool getIdlePowerDownTime(int &timer);
   void idlePowerDownTime(int timer);
   void name(String nom, bool normalized);
   String name(void);
+  bool getName(char *nom, size_t len);
   int volumeOnStartup();
+  bool getVolumeOnStartup(int &vol);
   void volumeOnStartup(int vol);
+  uint8_t apply(const Profile &profile);
+#endif
+
+#ifndef RN52_NO_CONFIG
+// Read cache for G-queries
+  void enableCache(unsigned long ttl);
+  void disableCache();
+  void cacheTTL(char opcode, unsigned long ttl);
+  void flushCache();
+
+// EEPROM snapshot of the cached settings
+  bool restoreSnapshot();
+  bool saveSnapshot();
+  bool snapshotVerified() { return _snapshotUnverified == 0; }
+  bool snapshotStale() { return _snapshotStale; }
+#endif
 
   void call(String number);
   void endCall();
 
+// Incoming calls, reported by update()
+  void eventPin(uint8_t pin);
+#ifndef RN52_NO_CALLS
+  void onRing(RN52CallCallback callback) { _onRing = callback; }
+  void onAnswer(RN52CallCallback callback) { _onAnswer = callback; }
+  void onHangUp(RN52CallCallback callback) { _onHangUp = callback; }
+  const char *callerID() { return _callerID; }
+  unsigned long callLatency() { return _callLatency; }
+#endif
+  void answerCall();
+  void rejectCall();
+
 // Audio Commands
   void volumeUp();
   void volumeDown();
@@ -135,6 +626,22 @@ public:
   void nextTrack();
   void prevTrack();
 
+// Audio Commands - coalesced, drained by update()
+  void update();
+  static void updateAll();
+  void volumeSteps(int steps);
+  void setVolume(uint8_t level);
+  int volume() { return _volume; }
+  void skipTracks(int tracks);
+  void verifySkips(bool verify) { _verifySkips = verify; }
+  bool stepsPending();
+
+// Command queue
+  bool queue(const char *cmd, uint8_t priority = RN52_NORMAL);
+  unsigned long urgentLatency() { return _urgentLatency; }
+  unsigned long urgentLatencyMax() { return _urgentLatencyMax; }
+
+#ifndef RN52_NO_METADATA
 // Audio Commands - metadata
   String getMetaData();
   String trackTitle();
@@ -143,20 +650,48 @@ public:
   String genre();
   int trackNumber();
   int trackCount();
+  void onMetaData(RN52MetaDataCallback callback) { _metaDataCallback = callback; }
+  uint8_t streamMetaData();
+  bool requestMetaData();
+  bool metaDataPending() { return _asyncActive; }
+#endif
+
+// Audio Commands - playback position, estimated locally
+  unsigned long trackLength() { return _trackLength; }
+  unsigned long trackPosition();
+  uint8_t trackProgress();
+  bool isPlaying() { return _playing; }
 
+#ifndef RN52_NO_CONNECTION
 // Connection Information
   String getConnectionData();
   String connectedMAC();
+  bool lastDevice(uint8_t *mac);
+  bool reconnect(unsigned long timeout = RN52_RECONNECT_TIMEOUT);
+  unsigned long connectTime() { return _connectTime; }
+
+// Paired device registry
+  bool addDevice(const char *mac, const char *name, int8_t volume = -1);
+  bool removeDevice(const char *mac);
+  void clearDevices();
+  const char *friendlyName() { return _friendlyName; }
+#endif
 
 // Event/Status Register Commands
   short getEventReg();
+  bool getEventReg(short &reg);
   bool trackChanged();
   bool isConnected();
+  unsigned long pollInterval() { return _pollInterval; }
+  Status status();
+  bool status(Status &s);
 
+#ifndef RN52_NO_CONFIG
 // RN52 Extended Features - Advanced
-  void setExtFeatures(bool state, int bit);
+  bool setExtFeatures(bool state, int bit);
   void setExtFeatures(short settings);
   short getExtFeatures();
+  bool getExtFeatures(short &features);
 
 // RN52 Extended Features - Functions
   bool AVRCPButtons();
@@ -188,12 +723,44 @@ public:
 
 // A2DP Audio Routing Commands
   short getAudioRouting();
+  bool getAudioRouting(short &routing);
+  void setAudioRouting(short routing);
   int sampleWidth();
   void sampleWidth(int width);
   int sampleRate();
   void sampleRate(int rate);
   int A2DPRoute();
   void A2DPRoute(int route);
+#endif
+};
+
+// Sends the same command to several RN52s at once, for multi-room
+// playback. The command is encoded once and sent to every member a byte
+// at a time, so the modules receive its final byte within a byte time
+// or so of each other rather than a whole command apart.
+class RN52Group
+{
+private:
+  RN52 *_members[RN52_GROUP_SIZE];
+  uint8_t _count;
+  unsigned long _skew;
+  unsigned long _skewMax;
+
+public:
+  RN52Group();
+  bool add(RN52 &member);
+  uint8_t size() { return _count; }
+
+  bool send(const char *cmd);
+  void playPause();
+  void nextTrack();
+  void prevTrack();
+  void volumeUp();
+  void volumeDown();
+
+  // Time between the first and last member finishing the last command (us)
+  unsigned long skew() { return _skew; }
+  unsigned long skewMax() { return _skewMax; }
 };
 
 // Arduino 0012 workaround
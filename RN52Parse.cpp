@@ -0,0 +1,114 @@
+/*
+	RN52Parse.cpp
+	Parsing of the RN52's replies, kept apart from the serial transport.
+	Nothing here includes Arduino or AVR headers, so it builds as is on a
+	host for testing against captured replies.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include "RN52Parse.h"
+
+// Parse the leading hex digits of text, the way every register reads back
+short RN52ParseHex(const char *text)
+{
+  uint16_t value = 0;
+  for (;; text++)
+  {
+    char c = *text;
+    if (c >= '0' && c <= '9')
+      value = (value << 4) | (c - '0');
+    else if (c >= 'A' && c <= 'F')
+      value = (value << 4) | (c - 'A' + 10);
+    else
+      return value;
+  }
+}
+
+// True for the lines that answer a command: AOK, ERR or '?'
+bool RN52IsAnswer(const char *line)
+{
+  return strcmp(line, "AOK") == 0 || strcmp(line, "ERR") == 0 || strcmp(line, "?") == 0;
+}
+
+// Decode the Q event register
+RN52Status RN52DecodeStatus(short reg)
+{
+  RN52Status s;
+  s.iAP           = reg & (1 << 8);
+  s.SPP           = reg & (1 << 9);
+  s.A2DP          = reg & (1 << 10);
+  s.HFP           = reg & (1 << 11);
+  s.callerID      = reg & (1 << 12);
+  s.trackChanged  = reg & (1 << 13);
+  s.state         = reg & 0x000F;
+  s.volumeChanged = reg & (1 << 4);
+  s.micChanged    = reg & (1 << 5);
+  return s;
+}
+
+// Returns the RN52_STATUS_* fields that differ between a and b
+uint16_t RN52CompareStatus(const RN52Status &a, const RN52Status &b)
+{
+  uint16_t changed = 0;
+  if (a.iAP != b.iAP)                     changed |= RN52_STATUS_IAP;
+  if (a.SPP != b.SPP)                     changed |= RN52_STATUS_SPP;
+  if (a.A2DP != b.A2DP)                   changed |= RN52_STATUS_A2DP;
+  if (a.HFP != b.HFP)                     changed |= RN52_STATUS_HFP;
+  if (a.callerID != b.callerID)           changed |= RN52_STATUS_CALLER_ID;
+  if (a.trackChanged != b.trackChanged)   changed |= RN52_STATUS_TRACK_CHANGED;
+  if (a.state != b.state)                 changed |= RN52_STATUS_STATE;
+  if (a.volumeChanged != b.volumeChanged) changed |= RN52_STATUS_VOLUME;
+  if (a.micChanged != b.micChanged)       changed |= RN52_STATUS_MIC;
+  return changed;
+}
+
+// Work out which metadata field a line of the AD reply holds. Returns
+// RN52_META_FIELDS if it isn't one we know, otherwise points value at
+// the text after the '='.
+uint8_t RN52MetaDataField(const char *line, const char **value)
+{
+  static const char *const keys[RN52_META_FIELDS] = {
+    "Title=", "Artist=", "Album=", "Genre=",
+    "TrackNumber=", "TrackCount=", "Time(ms)="
+  };
+
+  for (uint8_t i = 0; i < RN52_META_FIELDS; i++)
+  {
+    size_t len = strlen(keys[i]);
+    if (strncmp(line, keys[i], len) == 0)
+    {
+      *value = line + len;
+      return i;
+    }
+  }
+  return RN52_META_FIELDS;
+}
+
+// Turn the 12 hex digits of BTAC into 6 bytes
+bool RN52ParseMAC(const char *hex, uint8_t *mac)
+{
+  for (uint8_t i = 0; i < 12; i++)
+  {
+    char c = hex[i];
+    uint8_t nibble;
+    if (c >= '0' && c <= '9') nibble = c - '0';
+    else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+    else return false;
+    mac[i / 2] = (i & 1) ? (mac[i / 2] << 4) | nibble : nibble;
+  }
+  return true;
+}
@@ -0,0 +1,90 @@
+/*
+	RN52Parse.h
+	Parsing of the RN52's replies, kept apart from the serial transport.
+	Nothing here includes Arduino or AVR headers, so it builds as is on a
+	host for testing against captured replies.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RN52Parse_h
+#define RN52Parse_h
+
+#include <inttypes.h>
+
+// Connection states, the low nibble of the Q event register
+#define RN52_STATE_LIMBO              0
+#define RN52_STATE_CONNECTABLE        1
+#define RN52_STATE_DISCOVERABLE       2
+#define RN52_STATE_CONNECTED          3
+#define RN52_STATE_OUTGOING_CALL      4
+#define RN52_STATE_INCOMING_CALL      5
+#define RN52_STATE_ACTIVE_CALL        6
+#define RN52_STATE_TEST_MODE          7
+#define RN52_STATE_CALL_WAITING       8
+#define RN52_STATE_CALL_ON_HOLD       9
+#define RN52_STATE_MULTI_CALL         10
+#define RN52_STATE_INCOMING_ON_HOLD   11
+#define RN52_STATE_ACTIVE_CALL_HF     12
+#define RN52_STATE_AUDIO_STREAMING    13
+#define RN52_STATE_LOW_BATTERY        14
+
+// Status fields, as reported changed by RN52CompareStatus()
+#define RN52_STATUS_IAP           0x0001
+#define RN52_STATUS_SPP           0x0002
+#define RN52_STATUS_A2DP          0x0004
+#define RN52_STATUS_HFP           0x0008
+#define RN52_STATUS_CALLER_ID     0x0010
+#define RN52_STATUS_TRACK_CHANGED 0x0020
+#define RN52_STATUS_STATE         0x0040
+#define RN52_STATUS_VOLUME        0x0080
+#define RN52_STATUS_MIC           0x0100
+
+// Metadata fields, as reported by RN52MetaDataField(), streamMetaData()
+// and requestMetaData()
+#define RN52_META_TITLE        0
+#define RN52_META_ARTIST       1
+#define RN52_META_ALBUM        2
+#define RN52_META_GENRE        3
+#define RN52_META_TRACK_NUMBER 4
+#define RN52_META_TRACK_COUNT  5
+#define RN52_META_TIME         6
+#define RN52_META_FIELDS       7
+
+// The Q event register decoded
+struct RN52Status
+{
+  bool iAP;             // profiles with an active connection
+  bool SPP;
+  bool A2DP;
+  bool HFP;
+  bool callerID;        // caller ID information is waiting
+  bool trackChanged;
+  uint8_t state;        // one of RN52_STATE_*
+  bool volumeChanged;   // HFP speaker / microphone level changed
+  bool micChanged;
+
+  bool connected() const { return iAP || SPP || A2DP || HFP; }
+  bool streaming() const { return state == RN52_STATE_AUDIO_STREAMING; }
+};
+
+short RN52ParseHex(const char *text);
+bool RN52IsAnswer(const char *line);
+RN52Status RN52DecodeStatus(short reg);
+uint16_t RN52CompareStatus(const RN52Status &a, const RN52Status &b);
+uint8_t RN52MetaDataField(const char *line, const char **value);
+bool RN52ParseMAC(const char *hex, uint8_t *mac);
+
+#endif